@@ -64,6 +64,11 @@ u_minify(unsigned value, unsigned levels)
 #define EGL_PLATFORM_GBM_KHR              0x31D7
 #endif /* EGL_KHR_platform_gbm */
 
+#ifndef EGL_MESA_platform_surfaceless
+#define EGL_MESA_platform_surfaceless 1
+#define EGL_PLATFORM_SURFACELESS_MESA     0x31DD
+#endif /* EGL_MESA_platform_surfaceless */
+
 #ifndef EGL_EXT_platform_base
 #define EGL_EXT_platform_base 1
 typedef EGLDisplay (EGLAPIENTRYP PFNEGLGETPLATFORMDISPLAYEXTPROC) (EGLenum platform, void *native_display, const EGLint *attrib_list);
@@ -105,7 +110,8 @@ struct gbm {
 	int width, height;
 };
 
-const struct gbm * init_gbm(int drm_fd, int w, int h, uint32_t format, uint64_t modifier);
+int init_gbm(struct gbm *gbm, struct gbm_device *dev, int w, int h,
+	     uint32_t format, uint64_t *modifiers, unsigned int count);
 
 
 struct egl {
@@ -142,6 +148,7 @@ static inline int __egl_check(void *ptr, const char *name)
 
 struct egl* init_egl(ESContext *esContext, const struct gbm *gbm, int samples);
 int create_program(const char *vs_src, const char *fs_src);
+void bind_attrib_location(unsigned program, unsigned index, const char *name);
 int link_program(unsigned program);
 
 enum mode {
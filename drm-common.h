@@ -29,6 +29,7 @@
 
 struct gbm;
 struct egl;
+struct ESLayer;
 
 struct plane {
 	drmModePlane *plane;
@@ -63,7 +64,28 @@ struct drm {
 	uint32_t crtc_id;
 	uint32_t connector_id;
 
-	int (*run)(const struct gbm *gbm, const struct egl *egl);
+	/* the CRTC was already scanning out mode when we started */
+	int mode_active;
+
+	/* the CRTC has VRR_ENABLED, and what to set it to at modeset */
+	int has_vrr;
+	int vrr;
+
+	/* the plane scales a src_w x src_h buffer to the dst rectangle of
+	 * the CRTC; src_w == 0 shows it unscaled at the mode's size
+	 */
+	uint32_t src_w, src_h;
+	uint32_t dst_x, dst_y, dst_w, dst_h;
+
+	/* no display: fd is a render node (or -1), flips complete at once */
+	int headless;
+
+	/* overlay planes from esCreateLayer(), atomic only */
+	struct ESLayer *layers;
+
+	/* filled in by init_drm_legacy() or init_drm_atomic(): */
+	int (*modeset)(struct drm *drm, uint32_t fb_id);
+	int (*page_flip)(struct drm *drm, uint32_t fb_id, void *data);
 };
 
 struct drm_fb {
@@ -45,6 +45,7 @@
 #include <string.h>
 #include "esUtil.h"
 #include "esUtil_win.h"
+#include "esUtil_DRM.h"
 
 #ifdef ANDROID
 #include <android/log.h>
@@ -55,6 +56,13 @@ typedef AAsset esFile;
 typedef FILE esFile;
 #endif
 
+#if !defined(ANDROID) && !defined(_WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 #ifdef __APPLE__
 #include "FileWrapper.h"
 #endif
@@ -96,6 +104,34 @@ __attribute__ ( ( packed ) )
 #pragma pack(pop,x1)
 #endif
 
+///
+//  Globals
+//
+
+// The flags given to esCreateWindow(), for platforms whose WinCreate()
+// chooses the EGL config itself
+GLuint esWindowFlags = ES_WINDOW_RGB;
+
+///
+// esDebugEnabled()
+//
+//    ES_DEBUG set to anything but "" or "0" turns on the startup
+//    information dumps; the platform code shares this rule
+//
+GLboolean esDebugEnabled ( void )
+{
+   static int enabled = -1;
+
+   if ( enabled < 0 )
+   {
+      const char *env = getenv ( "ES_DEBUG" );
+
+      enabled = env != NULL && *env != '\0' && strcmp ( env, "0" ) != 0;
+   }
+
+   return enabled ? GL_TRUE : GL_FALSE;
+}
+
 #ifndef __APPLE__
 
 ///
@@ -147,6 +183,7 @@ GLboolean ESUTIL_API esCreateWindow ( ESContext *esContext, const char *title, G
    EGLint majorVersion;
    EGLint minorVersion;
    EGLint contextAttribs[] = { EGL_CONTEXT_CLIENT_VERSION, 3, EGL_NONE };
+   GLboolean created = GL_FALSE;
 
    if ( esContext == NULL )
    {
@@ -162,6 +199,7 @@ GLboolean ESUTIL_API esCreateWindow ( ESContext *esContext, const char *title, G
    esContext->width = width;
    esContext->height = height;
 #endif
+   esWindowFlags = flags;
 
    if ( !WinCreate ( esContext, title ) )
    {
@@ -187,16 +225,18 @@ GLboolean ESUTIL_API esCreateWindow ( ESContext *esContext, const char *title, G
 	 return GL_FALSE;
        }
 
-     printf("Using display %p with EGL version %d.%d\n",
-	    esContext->eglDisplay, majorVersion, minorVersion);
-
-    printf("===================================\n");
-    printf("EGL information:\n");
-    printf("  version: \"%s\"\n", eglQueryString(esContext->eglDisplay, EGL_VERSION));
-    printf("  vendor: \"%s\"\n", eglQueryString(esContext->eglDisplay, EGL_VENDOR));
-    //printf("  client extensions: \"%s\"\n", egl_exts_client);
-    //printf("  display extensions: \"%s\"\n", egl_exts_dpy);
-    printf("===================================\n");
+     if ( esDebugEnabled ( ) )
+     {
+        printf("Using display %p with EGL version %d.%d\n",
+               esContext->eglDisplay, majorVersion, minorVersion);
+        printf("===================================\n");
+        printf("EGL information:\n");
+        printf("  version: \"%s\"\n", eglQueryString(esContext->eglDisplay, EGL_VERSION));
+        printf("  vendor: \"%s\"\n", eglQueryString(esContext->eglDisplay, EGL_VENDOR));
+        //printf("  client extensions: \"%s\"\n", egl_exts_client);
+        //printf("  display extensions: \"%s\"\n", egl_exts_dpy);
+        printf("===================================\n");
+     }
 
      {
        EGLint numConfigs = 0;
@@ -249,6 +289,7 @@ GLboolean ESUTIL_API esCreateWindow ( ESContext *esContext, const char *title, G
 
    if (esContext->eglContext == NULL)
    {
+     created = GL_TRUE;
      // Create a GL context
      esContext->eglContext = eglCreateContext ( esContext->eglDisplay, config, 
 						EGL_NO_CONTEXT, contextAttribs );
@@ -259,19 +300,26 @@ GLboolean ESUTIL_API esCreateWindow ( ESContext *esContext, const char *title, G
       return GL_FALSE;
    }
 
-   // Make the context current
-   if ( !eglMakeCurrent ( esContext->eglDisplay, esContext->eglSurface, 
+   // Make the context current - the platform may already have done so
+   if ( eglGetCurrentContext ( ) != esContext->eglContext &&
+        !eglMakeCurrent ( esContext->eglDisplay, esContext->eglSurface, 
                           esContext->eglSurface, esContext->eglContext ) )
    {
       return GL_FALSE;
    }
-   printf("OpenGL ES information:\n");
-    printf("  version: \"%s\"\n", glGetString(GL_VERSION));
-    printf("  shading language version: \"%s\"\n", glGetString(GL_SHADING_LANGUAGE_VERSION));
-    printf("  vendor: \"%s\"\n", glGetString(GL_VENDOR));
-    printf("  renderer: \"%s\"\n", glGetString(GL_RENDERER));
-    //printf("  extensions: \"%s\"\n", gl_exts);
-    printf("===================================\n");
+
+   // The platform reports the GL it set up itself; only dump it here
+   // for a context of our own
+   if ( created && esDebugEnabled ( ) )
+   {
+      printf("OpenGL ES information:\n");
+      printf("  version: \"%s\"\n", glGetString(GL_VERSION));
+      printf("  shading language version: \"%s\"\n", glGetString(GL_SHADING_LANGUAGE_VERSION));
+      printf("  vendor: \"%s\"\n", glGetString(GL_VENDOR));
+      printf("  renderer: \"%s\"\n", glGetString(GL_RENDERER));
+      //printf("  extensions: \"%s\"\n", gl_exts);
+      printf("===================================\n");
+   }
 
 
 #endif // #ifndef __APPLE__
@@ -452,3 +500,408 @@ char *ESUTIL_API esLoadTGA ( void *ioContext, const char *fileName, int *width,
 
    return ( NULL );
 }
+
+///
+// esFileMap()
+//
+//    Make a whole file readable in memory, without copying it where the
+//    platform allows: mapped on POSIX, the asset's own buffer on Android.
+//
+typedef struct
+{
+   const unsigned char *data;
+   size_t               size;
+   void                *handle;
+} esFileMapping;
+
+static GLboolean esFileMap ( void *ioContext, const char *fileName, esFileMapping *map )
+{
+#if defined(ANDROID)
+   AAsset *asset = NULL;
+
+   if ( ioContext != NULL )
+   {
+      asset = AAssetManager_open ( ( AAssetManager * ) ioContext, fileName, AASSET_MODE_BUFFER );
+   }
+
+   if ( asset == NULL )
+   {
+      return GL_FALSE;
+   }
+
+   map->data = AAsset_getBuffer ( asset );
+   map->size = AAsset_getLength ( asset );
+   map->handle = asset;
+   return map->data != NULL;
+#elif defined(_WIN32)
+   FILE *fp = fopen ( fileName, "rb" );
+   long size;
+
+   if ( fp == NULL )
+   {
+      return GL_FALSE;
+   }
+
+   fseek ( fp, 0, SEEK_END );
+   size = ftell ( fp );
+   fseek ( fp, 0, SEEK_SET );
+   map->handle = malloc ( size );
+   map->data = map->handle;
+   map->size = size;
+
+   if ( map->handle == NULL || fread ( map->handle, size, 1, fp ) != 1 )
+   {
+      free ( map->handle );
+      fclose ( fp );
+      return GL_FALSE;
+   }
+
+   fclose ( fp );
+   return GL_TRUE;
+#else
+   struct stat st;
+   void *data;
+   int fd;
+
+#ifdef __APPLE__
+   fileName = GetBundleFileName ( fileName );
+#endif
+   fd = open ( fileName, O_RDONLY );
+
+   if ( fd < 0 )
+   {
+      return GL_FALSE;
+   }
+
+   if ( fstat ( fd, &st ) < 0 || st.st_size == 0 )
+   {
+      close ( fd );
+      return GL_FALSE;
+   }
+
+   data = mmap ( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+   close ( fd );
+
+   if ( data == MAP_FAILED )
+   {
+      return GL_FALSE;
+   }
+
+   map->data = data;
+   map->size = st.st_size;
+   map->handle = data;
+   return GL_TRUE;
+#endif
+}
+
+static void esFileUnmap ( esFileMapping *map )
+{
+#if defined(ANDROID)
+   AAsset_close ( ( AAsset * ) map->handle );
+#elif defined(_WIN32)
+   free ( map->handle );
+#else
+   munmap ( map->handle, map->size );
+#endif
+}
+
+//
+// Formats a KTX file may hold that GL ES 3.0 can upload directly.
+// ASTC (0x93B0-0x93BD and the sRGB 0x93D0-0x93DD) needs
+// GL_KHR_texture_compression_astc_ldr.
+//
+static GLboolean esKTXFormatSupported ( GLenum internalFormat )
+{
+   const char *extensions;
+
+   if ( ( internalFormat >= 0x93B0 && internalFormat <= 0x93BD ) ||
+        ( internalFormat >= 0x93D0 && internalFormat <= 0x93DD ) )
+   {
+      extensions = ( const char * ) glGetString ( GL_EXTENSIONS );
+      return extensions != NULL &&
+             strstr ( extensions, "GL_KHR_texture_compression_astc_ldr" ) != NULL;
+   }
+
+   return GL_TRUE;
+}
+
+//
+// Map a KTX2 VkFormat to the matching GL internal format, or 0
+//
+static GLenum esKTX2Format ( GLuint vkFormat, GLenum *format, GLenum *type )
+{
+   static const GLenum etc2[] =
+   {
+      GL_COMPRESSED_RGB8_ETC2,                        // 147
+      GL_COMPRESSED_SRGB8_ETC2,
+      GL_COMPRESSED_RGB8_PUNCHTHROUGH_ALPHA1_ETC2,
+      GL_COMPRESSED_SRGB8_PUNCHTHROUGH_ALPHA1_ETC2,
+      GL_COMPRESSED_RGBA8_ETC2_EAC,
+      GL_COMPRESSED_SRGB8_ALPHA8_ETC2_EAC,
+      GL_COMPRESSED_R11_EAC,
+      GL_COMPRESSED_SIGNED_R11_EAC,
+      GL_COMPRESSED_RG11_EAC,
+      GL_COMPRESSED_SIGNED_RG11_EAC,                  // 156
+   };
+
+   *format = GL_NONE;
+   *type = GL_NONE;
+
+   switch ( vkFormat )
+   {
+      case 23: // VK_FORMAT_R8G8B8_UNORM
+         *format = GL_RGB;
+         *type = GL_UNSIGNED_BYTE;
+         return GL_RGB8;
+      case 29: // VK_FORMAT_R8G8B8_SRGB
+         *format = GL_RGB;
+         *type = GL_UNSIGNED_BYTE;
+         return GL_SRGB8;
+      case 37: // VK_FORMAT_R8G8B8A8_UNORM
+         *format = GL_RGBA;
+         *type = GL_UNSIGNED_BYTE;
+         return GL_RGBA8;
+      case 43: // VK_FORMAT_R8G8B8A8_SRGB
+         *format = GL_RGBA;
+         *type = GL_UNSIGNED_BYTE;
+         return GL_SRGB8_ALPHA8;
+   }
+
+   if ( vkFormat >= 147 && vkFormat <= 156 )
+   {
+      return etc2[vkFormat - 147];
+   }
+
+   // ASTC LDR blocks, 4x4 to 12x12, UNORM and SRGB interleaved
+   if ( vkFormat >= 157 && vkFormat <= 184 )
+   {
+      return ( ( vkFormat - 157 ) & 1 ? 0x93D0 : 0x93B0 ) + ( vkFormat - 157 ) / 2;
+   }
+
+   return 0;
+}
+
+//
+// Read a little-endian 32 or 64-bit field from a KTX header
+//
+static GLuint esKTXRead32 ( const unsigned char *p )
+{
+   return p[0] | p[1] << 8 | p[2] << 16 | ( GLuint ) p[3] << 24;
+}
+
+static GLuint64 esKTXRead64 ( const unsigned char *p )
+{
+   return esKTXRead32 ( p ) | ( GLuint64 ) esKTXRead32 ( p + 4 ) << 32;
+}
+
+static GLsizei esKTXMinify ( GLsizei size, GLuint level )
+{
+   return ( size >> level ) > 0 ? size >> level : 1;
+}
+
+//
+// Upload one image of a mip level, compressed or not
+//
+static void esKTXUpload ( GLenum target, GLint level, GLenum internalFormat, GLenum format,
+                          GLenum type, GLsizei width, GLsizei height,
+                          const unsigned char *data, GLsizei size )
+{
+   if ( type == GL_NONE )
+   {
+      glCompressedTexImage2D ( target, level, internalFormat, width, height, 0, size, data );
+   }
+   else
+   {
+      glTexImage2D ( target, level, internalFormat, width, height, 0, format, type, data );
+   }
+}
+
+///
+// esLoadKTX()
+//
+//    Loads a 2D or cube map texture, with all its mip levels, from a KTX
+//    or KTX2 file. Compressed formats (ETC2/EAC, and ASTC where supported)
+//    go to the GPU as they are, straight from the mapped file.
+//
+GLuint ESUTIL_API esLoadKTX ( void *ioContext, const char *fileName, int *width, int *height )
+{
+   static const unsigned char ktx1Id[12] =
+      { 0xAB, 'K', 'T', 'X', ' ', '1', '1', 0xBB, '\r', '\n', 0x1A, '\n' };
+   static const unsigned char ktx2Id[12] =
+      { 0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n' };
+   esFileMapping map;
+   const unsigned char *p;
+   GLenum internalFormat = 0, format = GL_NONE, type = GL_NONE;
+   GLenum target = GL_TEXTURE_2D;
+   GLuint faces, levels, level, face;
+   GLuint64 pos;
+   GLboolean truncated = GL_FALSE;
+   GLsizei w, h;
+   GLuint texture = 0;
+
+   if ( !esFileMap ( ioContext, fileName, &map ) )
+   {
+      esLogMessage ( "esLoadKTX FAILED to load : { %s }\n", fileName );
+      return 0;
+   }
+
+   p = map.data;
+
+   // so that only errors from the upload are caught below
+   while ( glGetError() != GL_NO_ERROR )
+   {
+   }
+
+   if ( map.size >= 64 && memcmp ( p, ktx1Id, 12 ) == 0 &&
+        esKTXRead32 ( p + 12 ) == 0x04030201 )
+   {
+      // KTX 1: GL enums in the header, each level preceded by its size
+      type = esKTXRead32 ( p + 16 );
+      format = esKTXRead32 ( p + 24 );
+      internalFormat = esKTXRead32 ( p + 28 );
+      w = esKTXRead32 ( p + 36 );
+      h = esKTXRead32 ( p + 40 );
+      faces = esKTXRead32 ( p + 52 );
+      levels = esKTXRead32 ( p + 56 );
+
+      if ( esKTXRead32 ( p + 44 ) > 1 || esKTXRead32 ( p + 48 ) > 0 ||
+           ( faces != 1 && faces != 6 ) || !esKTXFormatSupported ( internalFormat ) )
+      {
+         esLogMessage ( "esLoadKTX: unsupported texture in %s\n", fileName );
+         esFileUnmap ( &map );
+         return 0;
+      }
+
+      target = faces == 6 ? GL_TEXTURE_CUBE_MAP : GL_TEXTURE_2D;
+      glGenTextures ( 1, &texture );
+      glBindTexture ( target, texture );
+      glPixelStorei ( GL_UNPACK_ALIGNMENT, 4 );
+
+      // every offset is checked against the file before it is used
+      pos = 64 + ( GLuint64 ) esKTXRead32 ( p + 60 );
+
+      for ( level = 0; level < ( levels ? levels : 1 ) && !truncated; level++ )
+      {
+         GLuint imageSize;
+
+         if ( pos + 4 > map.size )
+         {
+            truncated = GL_TRUE;
+            break;
+         }
+
+         imageSize = esKTXRead32 ( map.data + pos );
+         pos += 4;
+
+         for ( face = 0; face < faces; face++ )
+         {
+            if ( pos + imageSize > map.size )
+            {
+               truncated = GL_TRUE;
+               break;
+            }
+
+            esKTXUpload ( faces == 6 ? GL_TEXTURE_CUBE_MAP_POSITIVE_X + face : target,
+                          level, internalFormat, format, type,
+                          esKTXMinify ( w, level ), esKTXMinify ( h, level ),
+                          map.data + pos, imageSize );
+            // each image is padded to 4 bytes
+            pos += ( imageSize + 3 ) & ~3;
+         }
+      }
+   }
+   else if ( map.size >= 80 && memcmp ( p, ktx2Id, 12 ) == 0 )
+   {
+      // KTX 2: a Vulkan format and an index of where each level is
+      GLuint vkFormat = esKTXRead32 ( p + 12 );
+
+      w = esKTXRead32 ( p + 20 );
+      h = esKTXRead32 ( p + 24 );
+      faces = esKTXRead32 ( p + 36 );
+      levels = esKTXRead32 ( p + 40 );
+      internalFormat = esKTX2Format ( vkFormat, &format, &type );
+
+      if ( internalFormat == 0 || esKTXRead32 ( p + 28 ) > 1 ||
+           esKTXRead32 ( p + 32 ) > 0 || esKTXRead32 ( p + 44 ) != 0 ||
+           ( faces != 1 && faces != 6 ) ||
+           80 + ( GLuint64 ) ( levels ? levels : 1 ) * 24 > map.size ||
+           !esKTXFormatSupported ( internalFormat ) )
+      {
+         esLogMessage ( "esLoadKTX: unsupported texture in %s\n", fileName );
+         esFileUnmap ( &map );
+         return 0;
+      }
+
+      target = faces == 6 ? GL_TEXTURE_CUBE_MAP : GL_TEXTURE_2D;
+      glGenTextures ( 1, &texture );
+      glBindTexture ( target, texture );
+      glPixelStorei ( GL_UNPACK_ALIGNMENT, 1 );
+
+      for ( level = 0; level < ( levels ? levels : 1 ); level++ )
+      {
+         const unsigned char *index = map.data + 80 + level * 24;
+         GLuint64 offset = esKTXRead64 ( index );
+         GLuint64 length = esKTXRead64 ( index + 8 );
+
+         if ( offset > map.size || length > map.size - offset )
+         {
+            truncated = GL_TRUE;
+            break;
+         }
+
+         for ( face = 0; face < faces; face++ )
+         {
+            esKTXUpload ( faces == 6 ? GL_TEXTURE_CUBE_MAP_POSITIVE_X + face : target,
+                          level, internalFormat, format, type,
+                          esKTXMinify ( w, level ), esKTXMinify ( h, level ),
+                          map.data + offset + face * ( length / faces ),
+                          ( GLsizei ) ( length / faces ) );
+         }
+      }
+   }
+   else
+   {
+      esLogMessage ( "esLoadKTX: %s is not a KTX file\n", fileName );
+      esFileUnmap ( &map );
+      return 0;
+   }
+
+   esFileUnmap ( &map );
+
+   if ( truncated )
+   {
+      esLogMessage ( "esLoadKTX: %s is truncated\n", fileName );
+      glDeleteTextures ( 1, &texture );
+      return 0;
+   }
+
+   // a level count of 0, in either version, asks for the mips to be generated
+   if ( levels == 0 && type != GL_NONE )
+   {
+      glGenerateMipmap ( target );
+      levels = 2;
+   }
+
+   glTexParameteri ( target, GL_TEXTURE_MIN_FILTER,
+                     levels > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR );
+   glTexParameteri ( target, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
+
+   if ( glGetError() != GL_NO_ERROR )
+   {
+      esLogMessage ( "esLoadKTX: could not upload %s\n", fileName );
+      glDeleteTextures ( 1, &texture );
+      return 0;
+   }
+
+   if ( width != NULL )
+   {
+      *width = w;
+   }
+
+   if ( height != NULL )
+   {
+      *height = h;
+   }
+
+   return texture;
+}
@@ -50,9 +50,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <inttypes.h>
 #include <sys/time.h>
+#include <time.h>
 #include "esUtil.h"
-
+#include "esUtil_DRM.h"
 
 
 // from drm-common.c
@@ -61,8 +64,48 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <linux/videodev2.h>
+#include <linux/input.h>
+#include <linux/uinput.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include "drm-common.h"
 
+/* $XDG_CACHE_HOME/esUtil or ~/.cache/esUtil, created on first use */
+static const char *cache_dir(void)
+{
+    static char dir[512];
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+
+    if (dir[0])
+	return dir;
+
+    if (xdg && *xdg) {
+	snprintf(dir, sizeof(dir), "%s/esUtil", xdg);
+    } else if (home && *home) {
+	/* the parent of the default location may not exist yet either */
+	snprintf(dir, sizeof(dir), "%s/.cache", home);
+	mkdir(dir, 0700);
+	snprintf(dir, sizeof(dir), "%s/.cache/esUtil", home);
+    } else {
+	return NULL;
+    }
+
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+	dir[0] = '\0';
+	return NULL;
+    }
+    return dir;
+}
+
 static uint32_t find_crtc_for_encoder(const drmModeRes *resources,
 				      const drmModeEncoder *encoder) {
     int i;
@@ -120,7 +163,8 @@ static int find_drm_device(drmModeRes **resources)
     int num_devices, fd = -1;
 
     num_devices = drmGetDevices2(0, devices, MAX_DRM_DEVICES);
-    printf("Number of devices %d\n", num_devices);
+    if (esDebugEnabled())
+	printf("Number of devices %d\n", num_devices);
     if (num_devices < 0) {
 	printf("drmGetDevices2 failed: %s\n", strerror(-num_devices));
 	return -1;
@@ -152,12 +196,234 @@ static int find_drm_device(drmModeRes **resources)
     return fd;
 }
 
+// display cache
+
+/*
+ * The device, connector, CRTC and mode chosen by the last full probe
+ * are kept in a one line file. Checking them again takes a couple of
+ * ioctls, where the full probe makes every connector reprobe its
+ * display, which can mean reading EDID over a slow bus.
+ * ES_DRM_CACHE=0 always probes.
+ */
+static int display_cache_path(char *path, size_t size)
+{
+    const char *env = getenv("ES_DRM_CACHE");
+    const char *dir;
+
+    if (env && strcmp(env, "0") == 0)
+	return -1;
+    dir = cache_dir();
+    if (!dir)
+	return -1;
+    snprintf(path, size, "%s/display", dir);
+    return 0;
+}
+
+/* the timings, leaving out the type flags and name */
+static int mode_equal(const drmModeModeInfo *a, const drmModeModeInfo *b)
+{
+    return memcmp(a, b, offsetof(drmModeModeInfo, type)) == 0;
+}
+
+/* the preferred mode, or failing that the highest resolution one */
+static drmModeModeInfo *default_mode(drmModeConnector *connector)
+{
+    drmModeModeInfo *mode = NULL;
+    int i, area;
+
+    for (i = 0, area = 0; i < connector->count_modes; i++) {
+	drmModeModeInfo *current_mode = &connector->modes[i];
+
+	if (current_mode->type & DRM_MODE_TYPE_PREFERRED)
+	    return current_mode;
+
+	int current_area = current_mode->hdisplay * current_mode->vdisplay;
+	if (current_area > area) {
+	    mode = current_mode;
+	    area = current_area;
+	}
+    }
+    return mode;
+}
+
+/*
+ * The mode asked for by name, and refresh rate if given, or else the
+ * default one; *fallback is set when the request couldn't be met.
+ */
+static drmModeModeInfo *choose_mode(drmModeConnector *connector,
+				    const char *mode_str, unsigned int vrefresh,
+				    int *fallback)
+{
+    int i;
+
+    *fallback = 0;
+    if (mode_str && *mode_str) {
+	for (i = 0; i < connector->count_modes; i++) {
+	    drmModeModeInfo *current_mode = &connector->modes[i];
+
+	    if (strcmp(current_mode->name, mode_str) == 0 &&
+		(vrefresh == 0 || current_mode->vrefresh == vrefresh))
+		return current_mode;
+	}
+	*fallback = 1;
+    }
+    return default_mode(connector);
+}
+
+/*
+ * Set up drm from the cached configuration if it still holds: same
+ * request, the CRTC still there, and the connector still connected and
+ * offering a mode list from which the full probe would pick the very
+ * same timings. A new monitor that merely lists the old mode, but
+ * prefers another, doesn't count. Returns the connector, or NULL with
+ * drm left untouched when a full probe is needed.
+ */
+static drmModeConnector *display_cache_load(struct drm *drm, const char *device,
+					    const char *mode_str,
+					    unsigned int vrefresh)
+{
+    char path[600], node[256];
+    char request[DRM_DISPLAY_MODE_LEN];
+    unsigned int connector_id, crtc_id, request_vrefresh;
+    drmModeModeInfo cached = { 0 }, *mode;
+    int crtc_index, n, fd, fallback;
+    drmModeRes *resources = NULL;
+    drmModeConnector *connector = NULL;
+    FILE *f;
+
+    if (display_cache_path(path, sizeof(path)))
+	return NULL;
+    f = fopen(path, "r");
+    if (!f)
+	return NULL;
+    n = fscanf(f, "%255s %u %u %d %31s %u "
+	       "%u %hu %hu %hu %hu %hu %hu %hu %hu %hu %hu %u %u",
+	       node, &connector_id, &crtc_id, &crtc_index, request,
+	       &request_vrefresh, &cached.clock,
+	       &cached.hdisplay, &cached.hsync_start, &cached.hsync_end,
+	       &cached.htotal, &cached.hskew,
+	       &cached.vdisplay, &cached.vsync_start, &cached.vsync_end,
+	       &cached.vtotal, &cached.vscan, &cached.vrefresh, &cached.flags);
+    fclose(f);
+    if (n != 19)
+	return NULL;
+
+    if ((device && strcmp(device, node) != 0) ||
+	strcmp(request, mode_str && *mode_str ? mode_str : "-") != 0 ||
+	request_vrefresh != vrefresh)
+	return NULL;
+
+    fd = open(node, O_RDWR);
+    if (fd < 0)
+	return NULL;
+
+    resources = drmModeGetResources(fd);
+    if (!resources || crtc_index < 0 || crtc_index >= resources->count_crtcs ||
+	resources->crtcs[crtc_index] != crtc_id)
+	goto stale;
+
+    /* what the kernel last saw, without forcing a probe */
+    connector = drmModeGetConnectorCurrent(fd, connector_id);
+    if (!connector || connector->connection != DRM_MODE_CONNECTED)
+	goto stale;
+
+    /* the choice init_drm() would make now, down to the timings */
+    mode = choose_mode(connector, mode_str, vrefresh, &fallback);
+    if (!mode || !mode_equal(mode, &cached))
+	goto stale;
+
+    drmModeFreeResources(resources);
+    drm->mode = mode;
+    drm->fd = fd;
+    drm->connector_id = connector_id;
+    drm->crtc_id = crtc_id;
+    drm->crtc_index = crtc_index;
+    if (esDebugEnabled())
+	printf("Using cached display configuration from %s\n", path);
+    return connector;
+
+stale:
+    if (connector)
+	drmModeFreeConnector(connector);
+    if (resources)
+	drmModeFreeResources(resources);
+    close(fd);
+    return NULL;
+}
+
+static void display_cache_store(const struct drm *drm, const char *mode_str,
+				unsigned int vrefresh)
+{
+    char path[600], tmp[620];
+    char *node;
+    FILE *f;
+
+    if (display_cache_path(path, sizeof(path)))
+	return;
+    node = drmGetDeviceNameFromFd2(drm->fd);
+    if (!node)
+	return;
+
+    /* written under another name first, so readers never see half a file */
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    f = fopen(tmp, "w");
+    if (f) {
+	const drmModeModeInfo *m = drm->mode;
+
+	if (fprintf(f, "%s %u %u %d %s %u "
+		    "%u %hu %hu %hu %hu %hu %hu %hu %hu %hu %hu %u %u\n",
+		    node, drm->connector_id, drm->crtc_id, drm->crtc_index,
+		    mode_str && *mode_str ? mode_str : "-", vrefresh,
+		    m->clock, m->hdisplay, m->hsync_start, m->hsync_end,
+		    m->htotal, m->hskew, m->vdisplay, m->vsync_start,
+		    m->vsync_end, m->vtotal, m->vscan, m->vrefresh,
+		    m->flags) > 0 && fclose(f) == 0)
+	    rename(tmp, path);
+	else
+	    unlink(tmp);
+    }
+    free(node);
+}
+
+/*
+ * Is the CRTC already driving our connector with the mode we want,
+ * left there by the console or an earlier run? Then the first frame
+ * can go up without a full modeset and the blank screen that comes
+ * with it.
+ */
+static int display_mode_active(const struct drm *drm,
+			       const drmModeConnector *connector)
+{
+    drmModeEncoder *encoder;
+    drmModeCrtc *crtc;
+    int active = 0;
+
+    if (!connector->encoder_id)
+	return 0;
+    encoder = drmModeGetEncoder(drm->fd, connector->encoder_id);
+    if (!encoder)
+	return 0;
+    if (encoder->crtc_id == drm->crtc_id) {
+	crtc = drmModeGetCrtc(drm->fd, drm->crtc_id);
+	if (crtc) {
+	    active = crtc->mode_valid && mode_equal(&crtc->mode, drm->mode);
+	    drmModeFreeCrtc(crtc);
+	}
+    }
+    drmModeFreeEncoder(encoder);
+    return active;
+}
+
 int init_drm(struct drm *drm, const char *device, const char *mode_str, unsigned int vrefresh)
 {
     drmModeRes *resources;
     drmModeConnector *connector = NULL;
     drmModeEncoder *encoder = NULL;
-    int i, ret, area;
+    int i, ret, fallback;
+
+    connector = display_cache_load(drm, device, mode_str, vrefresh);
+    if (connector)
+	goto found;
 
     if (device) {
 	drm->fd = open(device, O_RDWR);
@@ -198,56 +464,25 @@ int init_drm(struct drm *drm, const char *device, const char *mode_str, unsigned
     }
 
     /* find user requested mode: */
-    if (mode_str && *mode_str) {
-	for (i = 0; i < connector->count_modes; i++) {
-	    drmModeModeInfo *current_mode = &connector->modes[i];
-
-	    if (strcmp(current_mode->name, mode_str) == 0) {
-		if (vrefresh == 0 || current_mode->vrefresh == vrefresh) {
-		    drm->mode = current_mode;
-		    break;
-		}
-	    }
-	}
-	if (!drm->mode)
-	    printf("requested mode not found, using default mode!\n");
-    }
-
-    /* find preferred mode or the highest resolution mode: */
-    if (!drm->mode) {
-	for (i = 0, area = 0; i < connector->count_modes; i++) {
-	    drmModeModeInfo *current_mode = &connector->modes[i];
-
-	    if (current_mode->type & DRM_MODE_TYPE_PREFERRED) {
-		drm->mode = current_mode;
-		break;
-	    }
-
-	    int current_area = current_mode->hdisplay * current_mode->vdisplay;
-	    if (current_area > area) {
-		drm->mode = current_mode;
-		area = current_area;
-	    }
-	}
-    }
+    drm->mode = choose_mode(connector, mode_str, vrefresh, &fallback);
+    if (fallback)
+	printf("requested mode not found, using default mode!\n");
 
     if (!drm->mode) {
 	printf("could not find mode!\n");
 	return -1;
     }
 
-    /* find encoder: */
-    for (i = 0; i < resources->count_encoders; i++) {
-	encoder = drmModeGetEncoder(drm->fd, resources->encoders[i]);
-	if (encoder->encoder_id == connector->encoder_id)
-	    break;
-	drmModeFreeEncoder(encoder);
-	encoder = NULL;
-    }
+    /* the encoder currently driving the connector, if any: */
+    if (connector->encoder_id)
+	encoder = drmModeGetEncoder(drm->fd, connector->encoder_id);
 
-    if (encoder) {
+    if (encoder && encoder->crtc_id) {
 	drm->crtc_id = encoder->crtc_id;
+	drmModeFreeEncoder(encoder);
     } else {
+	if (encoder)
+	    drmModeFreeEncoder(encoder);
 	uint32_t crtc_id = find_crtc_for_connector(drm, resources, connector);
 	if (crtc_id == 0) {
 	    printf("no crtc found!\n");
@@ -267,6 +502,12 @@ int init_drm(struct drm *drm, const char *device, const char *mode_str, unsigned
     drmModeFreeResources(resources);
 
     drm->connector_id = connector->connector_id;
+    display_cache_store(drm, mode_str, vrefresh);
+
+found:
+    drm->mode_active = display_mode_active(drm, connector);
+    drm->kms_in_fence_fd = -1;
+    drm->kms_out_fence_fd = -1;
 
     return 0;
 }
@@ -283,41 +524,59 @@ gbm_surface_create_with_modifiers(struct gbm_device *gbm,
                                   const uint64_t *modifiers,
                                   const unsigned int count);
 
-const struct gbm * init_gbm(int drm_fd, int w, int h, uint32_t format, uint64_t modifier)
+static unsigned int egl_filter_modifiers(struct gbm_device *dev, uint32_t format,
+					 uint64_t *modifiers, unsigned int count);
+
+/*
+ * Create a scanout surface on dev, letting GBM pick the best layout
+ * from the modifiers we can both render to and scan out. With no list
+ * the driver chooses, which is usually a linear or implicitly tiled
+ * layout. A list of just DRM_FORMAT_MOD_LINEAR always gets a linear
+ * surface. Every output's surface comes from the same device, since
+ * EGL can only render to surfaces of the device its display was
+ * created for.
+ */
+int init_gbm(struct gbm *gbm, struct gbm_device *dev, int w, int h,
+	     uint32_t format, uint64_t *modifiers, unsigned int count)
 {
-    static struct gbm gbm;
+    /* every GPU can render to linear, no need to ask EGL */
+    int linear = count == 1 && modifiers[0] == DRM_FORMAT_MOD_LINEAR;
 
-    gbm.dev = gbm_create_device(drm_fd);
-    gbm.format = format;
-    gbm.surface = NULL;
+    gbm->dev = dev;
+    gbm->format = format;
+    gbm->surface = NULL;
 
-    if (gbm_surface_create_with_modifiers) {
-	gbm.surface = gbm_surface_create_with_modifiers(gbm.dev, w, h,
-							gbm.format,
-							&modifier, 1);
+    if (!dev)
+	return -1;
 
-    }
+    if (count && !linear && gbm_surface_create_with_modifiers)
+	count = egl_filter_modifiers(gbm->dev, format, modifiers, count);
 
-    if (!gbm.surface) {
-	if (modifier != DRM_FORMAT_MOD_LINEAR) {
-	    fprintf(stderr, "Modifiers requested but support isn't available\n");
-	    return NULL;
-	}
-	gbm.surface = gbm_surface_create(gbm.dev, w, h,
-					 gbm.format,
-					 GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING);
+    if (count && gbm_surface_create_with_modifiers) {
+	gbm->surface = gbm_surface_create_with_modifiers(gbm->dev, w, h,
+							 gbm->format,
+							 modifiers, count);
+	if (!gbm->surface)
+	    printf("no surface with any of %u modifiers, trying without\n",
+		   count);
+    }
 
+    if (!gbm->surface) {
+	gbm->surface = gbm_surface_create(gbm->dev, w, h,
+					  gbm->format,
+					  GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING |
+					  (linear ? GBM_BO_USE_LINEAR : 0));
     }
 
-    if (!gbm.surface) {
+    if (!gbm->surface) {
 	printf("failed to create gbm surface\n");
-	return NULL;
+	return -1;
     }
 
-    gbm.width = w;
-    gbm.height = h;
+    gbm->width = w;
+    gbm->height = h;
 
-    return &gbm;
+    return 0;
 }
 
 static bool has_ext(const char *extension_list, const char *ext)
@@ -340,6 +599,54 @@ static bool has_ext(const char *extension_list, const char *ext)
     }
 }
 
+/*
+ * Drop the modifiers EGL can't render to from the list, in place.
+ * The EGL display is the one init_egl() will get again for this
+ * device, so initialising it here costs nothing extra.
+ */
+static unsigned int egl_filter_modifiers(struct gbm_device *dev, uint32_t format,
+					 uint64_t *modifiers, unsigned int count)
+{
+    PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+	(void *)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    PFNEGLQUERYDMABUFMODIFIERSEXTPROC query_modifiers =
+	(void *)eglGetProcAddress("eglQueryDmaBufModifiersEXT");
+    EGLDisplay display;
+    EGLuint64KHR *egl_mods;
+    EGLBoolean *external;
+    EGLint num = 0;
+    unsigned int i, n = 0;
+    int j;
+
+    display = get_platform_display ?
+	get_platform_display(EGL_PLATFORM_GBM_KHR, dev, NULL) :
+	eglGetDisplay((void *)dev);
+    if (!query_modifiers || !eglInitialize(display, NULL, NULL) ||
+	!has_ext(eglQueryString(display, EGL_EXTENSIONS),
+		 "EGL_EXT_image_dma_buf_import_modifiers") ||
+	!query_modifiers(display, format, 0, NULL, NULL, &num) || num <= 0)
+	return 0;
+
+    egl_mods = calloc(num, sizeof(*egl_mods));
+    external = calloc(num, sizeof(*external));
+    if (egl_mods && external &&
+	query_modifiers(display, format, num, egl_mods, external, &num)) {
+	for (i = 0; i < count; i++) {
+	    for (j = 0; j < num; j++) {
+		/* external-only layouts can be sampled but not drawn to */
+		if (egl_mods[j] == modifiers[i] && !external[j]) {
+		    modifiers[n++] = modifiers[i];
+		    break;
+		}
+	    }
+	}
+    }
+    free(egl_mods);
+    free(external);
+
+    return n;
+}
+
 static int
 match_config_to_visual(EGLDisplay egl_display,
 		       EGLint visual_id,
@@ -406,6 +713,28 @@ out:
     return true;
 }
 
+/*
+ * Samples per pixel for ES_WINDOW_MULTISAMPLE, 4 unless ES_DRM_SAMPLES
+ * says otherwise; 0 without it. The window surface itself is
+ * multisampled, which tile-based GPUs resolve as each tile is written
+ * out rather than in a separate full-size pass.
+ */
+static int window_samples(void)
+{
+    const char *env = getenv("ES_DRM_SAMPLES");
+
+    if (!(esWindowFlags & ES_WINDOW_MULTISAMPLE))
+	return 0;
+    return env && *env ? MAX2(0, atoi(env)) : 4;
+}
+
+/* scanout with an alpha channel only when it was asked for */
+static uint32_t window_format(void)
+{
+    return (esWindowFlags & ES_WINDOW_ALPHA) ? DRM_FORMAT_ARGB8888
+					     : DRM_FORMAT_XRGB8888;
+}
+
 struct egl * init_egl(ESContext *esContext, const struct gbm *gbm, int samples)
 {
     static struct egl static_egl;
@@ -419,17 +748,27 @@ struct egl * init_egl(ESContext *esContext, const struct gbm *gbm, int samples)
 	EGL_NONE
     };
 
-    const EGLint config_attribs[] = {
-	EGL_SURFACE_TYPE, EGL_WINDOW_BIT,
+    /* without GBM we are headless on the surfaceless platform, and
+     * render to a pbuffer. Depth, stencil and alpha only when the
+     * ES_WINDOW_* flags ask for them: EGL sorts the smallest buffers
+     * first, so a config without them wins whenever there is one.
+     */
+    EGLint config_attribs[] = {
+	EGL_SURFACE_TYPE, gbm ? EGL_WINDOW_BIT : EGL_PBUFFER_BIT,
 	EGL_RED_SIZE, 1,
 	EGL_GREEN_SIZE, 1,
 	EGL_BLUE_SIZE, 1,
-	EGL_ALPHA_SIZE, 0,
+	EGL_ALPHA_SIZE, (esWindowFlags & ES_WINDOW_ALPHA) ? 8 : 0,
+	EGL_DEPTH_SIZE, (esWindowFlags & ES_WINDOW_DEPTH) ? 8 : 0,
+	EGL_STENCIL_SIZE, (esWindowFlags & ES_WINDOW_STENCIL) ? 8 : 0,
 	//EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
 	EGL_RENDERABLE_TYPE, EGL_OPENGL_ES3_BIT_KHR, // JN
-	// JN EGL_SAMPLES, samples,
+	EGL_SAMPLE_BUFFERS, samples > 0,
+	EGL_SAMPLES, samples,
 	EGL_NONE
     };
+    EGLint value;
+    int i;
     const char *egl_exts_client, *egl_exts_dpy, *gl_exts;
 
 #define get_proc_client(ext, name) do {				\
@@ -450,7 +789,15 @@ struct egl * init_egl(ESContext *esContext, const struct gbm *gbm, int samples)
     get_proc_client(EGL_EXT_platform_base, eglGetPlatformDisplayEXT);
 
     // Ensure we get DRM platform, and not say X11 or Wayland
-    if (egl->eglGetPlatformDisplayEXT) {
+    if (!gbm) {
+	if (!egl->eglGetPlatformDisplayEXT ||
+	    !has_ext(egl_exts_client, "EGL_MESA_platform_surfaceless")) {
+	    printf("no EGL_MESA_platform_surfaceless\n");
+	    return NULL;
+	}
+	egl->display = egl->eglGetPlatformDisplayEXT(EGL_PLATFORM_SURFACELESS_MESA,
+						     EGL_DEFAULT_DISPLAY, NULL);
+    } else if (egl->eglGetPlatformDisplayEXT) {
 	egl->display = egl->eglGetPlatformDisplayEXT(EGL_PLATFORM_GBM_KHR,
 						     gbm->dev, NULL);
     } else {
@@ -475,27 +822,44 @@ struct egl * init_egl(ESContext *esContext, const struct gbm *gbm, int samples)
     egl->modifiers_supported = has_ext(egl_exts_dpy,
 				       "EGL_EXT_image_dma_buf_import_modifiers");
 
-    printf("Using display %p with EGL version %d.%d\n",
-	   egl->display, major, minor);
-
-    printf("===================================\n");
-    printf("EGL information:\n");
-    printf("  version: \"%s\"\n", eglQueryString(egl->display, EGL_VERSION));
-    printf("  vendor: \"%s\"\n", eglQueryString(egl->display, EGL_VENDOR));
-    printf("  client extensions: \"%s\"\n", egl_exts_client);
-    printf("  display extensions: \"%s\"\n", egl_exts_dpy);
-    printf("===================================\n");
+    if (esDebugEnabled()) {
+	printf("Using display %p with EGL version %d.%d\n",
+	       egl->display, major, minor);
+
+	printf("===================================\n");
+	printf("EGL information:\n");
+	printf("  version: \"%s\"\n", eglQueryString(egl->display, EGL_VERSION));
+	printf("  vendor: \"%s\"\n", eglQueryString(egl->display, EGL_VENDOR));
+	printf("  client extensions: \"%s\"\n", egl_exts_client);
+	printf("  display extensions: \"%s\"\n", egl_exts_dpy);
+	printf("===================================\n");
+    }
 
     if (!eglBindAPI(EGL_OPENGL_ES_API)) {
 	printf("failed to bind api EGL_OPENGL_ES_API\n");
 	return NULL;
     }
 
-    if (!egl_choose_config(egl->display, config_attribs, gbm->format,
+    if (samples > 0 &&
+	!egl_choose_config(egl->display, config_attribs, gbm ? gbm->format : 0,
+			   &egl->config)) {
+	printf("no %dx multisampled config, rendering without\n", samples);
+	for (i = 0; config_attribs[i] != EGL_NONE; i += 2) {
+	    if (config_attribs[i] == EGL_SAMPLE_BUFFERS ||
+		config_attribs[i] == EGL_SAMPLES)
+		config_attribs[i + 1] = 0;
+	}
+	samples = 0;
+    }
+    if (!samples &&
+	!egl_choose_config(egl->display, config_attribs, gbm ? gbm->format : 0,
 			   &egl->config)) {
 	printf("failed to choose config\n");
 	return NULL;
     }
+    if (samples && eglGetConfigAttrib(egl->display, egl->config,
+				      EGL_SAMPLES, &value))
+	printf("Using %dx multisampling\n", value);
 
     egl->context = eglCreateContext(egl->display, egl->config,
 				    EGL_NO_CONTEXT, context_attribs);
@@ -505,8 +869,19 @@ struct egl * init_egl(ESContext *esContext, const struct gbm *gbm, int samples)
     }
     esContext->eglContext = egl->context;
 	
-    egl->surface = eglCreateWindowSurface(egl->display, egl->config,
-					  (EGLNativeWindowType)gbm->surface, NULL);
+    if (gbm) {
+	egl->surface = eglCreateWindowSurface(egl->display, egl->config,
+					      (EGLNativeWindowType)gbm->surface, NULL);
+    } else {
+	const EGLint pbuffer_attribs[] = {
+	    EGL_WIDTH, esContext->width,
+	    EGL_HEIGHT, esContext->height,
+	    EGL_NONE
+	};
+
+	egl->surface = eglCreatePbufferSurface(egl->display, egl->config,
+					       pbuffer_attribs);
+    }
     esContext->eglSurface = egl->surface;
 	
     if (egl->surface == EGL_NO_SURFACE) {
@@ -518,173 +893,4419 @@ struct egl * init_egl(ESContext *esContext, const struct gbm *gbm, int samples)
     eglMakeCurrent(egl->display, egl->surface, egl->surface, egl->context);
 
     gl_exts = (char *) glGetString(GL_EXTENSIONS);
-    printf("OpenGL ES information:\n");
-    printf("  version: \"%s\"\n", glGetString(GL_VERSION));
-    printf("  shading language version: \"%s\"\n", glGetString(GL_SHADING_LANGUAGE_VERSION));
-    printf("  vendor: \"%s\"\n", glGetString(GL_VENDOR));
-    printf("  renderer: \"%s\"\n", glGetString(GL_RENDERER));
-    printf("  extensions: \"%s\"\n", gl_exts);
-    printf("===================================\n");
+    if (esDebugEnabled()) {
+	printf("OpenGL ES information:\n");
+	printf("  version: \"%s\"\n", glGetString(GL_VERSION));
+	printf("  shading language version: \"%s\"\n", glGetString(GL_SHADING_LANGUAGE_VERSION));
+	printf("  vendor: \"%s\"\n", glGetString(GL_VENDOR));
+	printf("  renderer: \"%s\"\n", glGetString(GL_RENDERER));
+	printf("  extensions: \"%s\"\n", gl_exts);
+	printf("===================================\n");
+    } else {
+	printf("Using %s on %s\n", glGetString(GL_VERSION), glGetString(GL_RENDERER));
+    }
 
     get_proc_gl(GL_OES_EGL_image, glEGLImageTargetTexture2DOES);
 
     return egl;
 }
 
-// from drm-legacy
-static struct drm drm_static;
-
-const struct drm * init_drm_legacy(const char *device, const char *mode_str, unsigned int vrefresh)
-{
-    int ret;
+/*
+ * create_program() and link_program(), as in kmscube, but with the
+ * linked program cached on disk. Compiling from source takes seconds
+ * with some GLSL compilers, so create_program() only records the
+ * sources and link_program() first tries a binary saved by an earlier
+ * run, keyed by a hash of the sources, the attribute bindings made with
+ * bind_attrib_location() and the driver's GL_RENDERER and GL_VERSION.
+ * A binary the driver rejects is simply rebuilt.
+ */
+struct program_source {
+    GLuint program;
+    char *vs_src, *fs_src;
+    uint64_t hash;
+    struct program_source *next;
+};
 
-    ret = init_drm(&drm_static, device, mode_str, vrefresh);
-    if (ret)
-	return NULL;
+static struct program_source *program_sources;
 
-    return &drm_static;
+static uint64_t fnv1a(uint64_t hash, const char *str)
+{
+    /* include the terminator so "ab" + "c" differs from "a" + "bc" */
+    do {
+	hash ^= (unsigned char)*str;
+	hash *= 0x100000001b3ull;
+    } while (*str++);
+    return hash;
 }
 
+static const char *program_cache_dir(void)
+{
+    static char dir[512];
+    const char *env = getenv("ES_SHADER_CACHE");
 
-// From kmscube.c
+    if (dir[0])
+	return dir;
+    if (env && strcmp(env, "0") == 0)
+	return NULL;
+    if (!env || !*env)
+	return cache_dir();
 
-#include "drm-common.h"
+    snprintf(dir, sizeof(dir), "%s", env);
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+	dir[0] = '\0';
+	return NULL;
+    }
+    return dir;
+}
 
-static const struct egl *egl;
-static const struct gbm *gbm;
-static const struct drm *drm;
+static void program_cache_path(char *path, size_t size, uint64_t hash)
+{
+    snprintf(path, size, "%s/%016" PRIx64 ".bin", program_cache_dir(), hash);
+}
 
-///
-//  WinCreate()
-//
-//      This function initialized the native X11 display and window for EGL
-//
-EGLBoolean WinCreate(ESContext *esContext, const char *title)
+/* returns 0 if the program was linked from a cached binary */
+static int program_cache_load(GLuint program, uint64_t hash)
 {
-    const char *device = NULL;
-    const char *video = NULL;
-    char mode_str[DRM_DISPLAY_MODE_LEN] = "";
-    char *p;
-    enum mode mode = SMOOTH;
-    uint32_t format = DRM_FORMAT_XRGB8888;
-    uint64_t modifier = DRM_FORMAT_MOD_LINEAR;
-    int samples = 0;
-    int atomic = 0;
-    int opt;
-    unsigned int len;
-    unsigned int vrefresh = 0;
+    char path[600];
+    struct {
+	char magic[4];
+	GLenum format;
+	GLint length;
+    } header;
+    void *binary;
+    GLint ret = 0;
+    FILE *f;
+
+    program_cache_path(path, sizeof(path), hash);
+    f = fopen(path, "rb");
+    if (!f)
+	return -1;
 
-    if (atomic)
-	//drm = init_drm_atomic(device, mode_str, vrefresh);
-	1; // JN - don't know what atomic does, ignore for now
-    else
-	drm = init_drm_legacy(device, mode_str, vrefresh);
-    if (!drm) {
-	printf("failed to initialize %s DRM\n", atomic ? "atomic" : "legacy");
+    if (fread(&header, sizeof(header), 1, f) != 1 ||
+	memcmp(header.magic, "ESPB", 4) != 0 || header.length <= 0 ||
+	!(binary = malloc(header.length))) {
+	fclose(f);
 	return -1;
     }
+    if (fread(binary, header.length, 1, f) == 1) {
+	glProgramBinary(program, header.format, binary, header.length);
+	glGetProgramiv(program, GL_LINK_STATUS, &ret);
+    }
+    free(binary);
+    fclose(f);
 
-    gbm = init_gbm(drm->fd, drm->mode->hdisplay, drm->mode->vdisplay,
-		   format, modifier);
-    if (!gbm) {
-	printf("failed to initialize GBM\n");
+    if (!ret) {
+	/* stale after a driver update, most likely */
+	unlink(path);
 	return -1;
     }
-    esContext->platformData = (void *) gbm;
-	
-    egl = init_egl(esContext, gbm, 0); // JN lose 0 later
-
-    esContext->eglNativeDisplay = (EGLNativeDisplayType) gbm->dev;
-    return EGL_TRUE;
+    return 0;
 }
 
-// from drm-common.c
-static void
-drm_fb_destroy_callback(struct gbm_bo *bo, void *data)
+static void program_cache_store(GLuint program, uint64_t hash)
 {
-    int drm_fd = gbm_device_get_fd(gbm_bo_get_device(bo));
-    struct drm_fb *fb = data;
+    char path[600], tmp[620];
+    struct {
+	char magic[4];
+	GLenum format;
+	GLint length;
+    } header = { .magic = "ESPB" };
+    void *binary;
+    FILE *f;
+
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &header.length);
+    if (header.length <= 0 || !(binary = malloc(header.length)))
+	return;
+    glGetProgramBinary(program, header.length, &header.length, &header.format,
+		       binary);
+
+    /* written under another name first, so readers never see half a file */
+    program_cache_path(path, sizeof(path), hash);
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    f = fopen(tmp, "wb");
+    if (f) {
+	if (fwrite(&header, sizeof(header), 1, f) == 1 &&
+	    fwrite(binary, header.length, 1, f) == 1 && fclose(f) == 0)
+	    rename(tmp, path);
+	else
+	    unlink(tmp);
+    }
+    free(binary);
+}
 
-    if (fb->fb_id)
-	drmModeRmFB(drm_fd, fb->fb_id);
+static GLuint compile_shader(GLenum type, const char *src)
+{
+    GLuint shader = glCreateShader(type);
+    GLint ret;
+
+    glShaderSource(shader, 1, &src, NULL);
+    glCompileShader(shader);
+
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &ret);
+    if (!ret) {
+	char *log;
+
+	printf("%s shader compilation failed!:\n",
+	       type == GL_VERTEX_SHADER ? "vertex" : "fragment");
+	glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &ret);
+	if (ret > 1) {
+	    log = malloc(ret);
+	    glGetShaderInfoLog(shader, ret, NULL, log);
+	    printf("%s", log);
+	    free(log);
+	}
+	glDeleteShader(shader);
+	return 0;
+    }
 
-    free(fb);
+    return shader;
 }
 
-struct drm_fb * drm_fb_get_from_bo(struct gbm_bo *bo)
+int create_program(const char *vs_src, const char *fs_src)
 {
-    int drm_fd = gbm_device_get_fd(gbm_bo_get_device(bo));
-    struct drm_fb *fb = gbm_bo_get_user_data(bo);
-    uint32_t width, height, format,
-	strides[4] = {0}, handles[4] = {0},
-	offsets[4] = {0}, flags = 0;
-    int ret = -1;
+    struct program_source *ps = calloc(1, sizeof(*ps));
+    GLint formats = 0;
 
-    if (fb)
-	return fb;
+    if (!ps)
+	return -1;
+    ps->vs_src = strdup(vs_src);
+    ps->fs_src = strdup(fs_src);
+    ps->program = glCreateProgram();
+    if (!ps->vs_src || !ps->fs_src || !ps->program) {
+	free(ps->vs_src);
+	free(ps->fs_src);
+	free(ps);
+	return -1;
+    }
 
-    fb = calloc(1, sizeof *fb);
-    fb->bo = bo;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    if (formats > 0 && program_cache_dir()) {
+	ps->hash = fnv1a(0xcbf29ce484222325ull, vs_src);
+	ps->hash = fnv1a(ps->hash, fs_src);
+	ps->hash = fnv1a(ps->hash, (const char *)glGetString(GL_RENDERER));
+	ps->hash = fnv1a(ps->hash, (const char *)glGetString(GL_VERSION));
+    }
 
-    width = gbm_bo_get_width(bo);
-    height = gbm_bo_get_height(bo);
-    format = gbm_bo_get_format(bo);
+    ps->next = program_sources;
+    program_sources = ps;
 
-    if (gbm_bo_get_modifier && gbm_bo_get_plane_count &&
-	gbm_bo_get_stride_for_plane && gbm_bo_get_offset) {
+    return ps->program;
+}
 
-	uint64_t modifiers[4] = {0};
-	modifiers[0] = gbm_bo_get_modifier(bo);
-	const int num_planes = gbm_bo_get_plane_count(bo);
-	for (int i = 0; i < num_planes; i++) {
-	    strides[i] = gbm_bo_get_stride_for_plane(bo, i);
-	    handles[i] = gbm_bo_get_handle(bo).u32;
-	    offsets[i] = gbm_bo_get_offset(bo, i);
-	    modifiers[i] = modifiers[0];
-	}
+/*
+ * glBindAttribLocation() for a program between create_program() and
+ * link_program(). A cached binary keeps the locations it was linked
+ * with, so the binding has to be part of the key to be honoured.
+ */
+void bind_attrib_location(unsigned program, unsigned index, const char *name)
+{
+    struct program_source *ps;
+    char buf[16];
+
+    for (ps = program_sources; ps && ps->program != program; ps = ps->next)
+	;
+    if (ps && ps->hash) {
+	snprintf(buf, sizeof(buf), "%u", index);
+	ps->hash = fnv1a(ps->hash, buf);
+	ps->hash = fnv1a(ps->hash, name);
+    }
 
-	if (modifiers[0]) {
-	    flags = DRM_MODE_FB_MODIFIERS;
-	    printf("Using modifier % PRIx64 \n", modifiers[0]);
-	}
+    glBindAttribLocation(program, index, name);
+}
 
-	ret = drmModeAddFB2WithModifiers(drm_fd, width, height,
-					 format, handles, strides, offsets,
-					 modifiers, &fb->fb_id, flags);
+int link_program(unsigned program)
+{
+    struct program_source **pp, *ps;
+    GLuint vs = 0, fs = 0;
+    GLint ret = 0;
+
+    for (pp = &program_sources; *pp && (*pp)->program != program; pp = &(*pp)->next)
+	;
+    ps = *pp;
+    if (!ps)
+	return -1;
+    *pp = ps->next;
+
+    if (ps->hash && program_cache_load(program, ps->hash) == 0) {
+	ret = 1;
+	goto out;
     }
 
-    if (ret) {
-	if (flags)
-	    fprintf(stderr, "Modifiers failed!\n");
+    vs = compile_shader(GL_VERTEX_SHADER, ps->vs_src);
+    fs = vs ? compile_shader(GL_FRAGMENT_SHADER, ps->fs_src) : 0;
+    if (!fs)
+	goto out;
 
-	memcpy(handles, (uint32_t [4]){gbm_bo_get_handle(bo).u32,0,0,0}, 16);
-	memcpy(strides, (uint32_t [4]){gbm_bo_get_stride(bo),0,0,0}, 16);
-	memset(offsets, 0, 16);
-	ret = drmModeAddFB2(drm_fd, width, height, format,
+    glAttachShader(program, vs);
+    glAttachShader(program, fs);
+    if (ps->hash)
+	glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glLinkProgram(program);
+
+    glGetProgramiv(program, GL_LINK_STATUS, &ret);
+    if (!ret) {
+	char *log;
+	GLint len;
+
+	printf("program linking failed!:\n");
+	glGetProgramiv(program, GL_INFO_LOG_LENGTH, &len);
+	if (len > 1) {
+	    log = malloc(len);
+	    glGetProgramInfoLog(program, len, NULL, log);
+	    printf("%s", log);
+	    free(log);
+	}
+    } else if (ps->hash) {
+	program_cache_store(program, ps->hash);
+    }
+
+    glDetachShader(program, vs);
+    glDetachShader(program, fs);
+
+out:
+    if (vs)
+	glDeleteShader(vs);
+    if (fs)
+	glDeleteShader(fs);
+    free(ps->vs_src);
+    free(ps->fs_src);
+    free(ps);
+
+    return ret ? 0 : -1;
+}
+
+///
+//  esLoadProgramCached()
+//
+GLuint ESUTIL_API esLoadProgramCached ( const char *vertShaderSrc, const char *fragShaderSrc )
+{
+    int program = create_program(vertShaderSrc, fragShaderSrc);
+
+    if (program <= 0)
+	return 0;
+    if (link_program(program)) {
+	glDeleteProgram(program);
+	return 0;
+    }
+    return program;
+}
+
+// outputs
+
+/* the page flip in flight, if any */
+struct flip {
+    int waiting;
+    struct gbm_surface *surface;
+    struct gbm_bo *release_bo;	/* given back to GBM when the flip completes */
+    unsigned int frame;		/* vblank count of the last completed flip */
+    unsigned int completed;	/* flips completed so far */
+    double time;		/* and when it hit the screen */
+    double input_time;		/* of the oldest input the frame answers, or 0 */
+};
+
+/*
+ * A display we draw to: its connector, CRTC and plane, its scanout
+ * surface with an EGL window surface for the one shared context, and
+ * its own page flip. outputs[0] is the display init_drm() picked, and
+ * the one headless rendering uses; ES_DRM_OUTPUTS adds the others.
+ */
+#define MAX_OUTPUTS 8
+
+struct output {
+    struct drm drm;
+    struct gbm gbm;
+    EGLSurface surface;
+    struct flip flip;
+    struct gbm_bo *bo;		/* on screen, or on its way there */
+    int x;			/* left edge in the row of displays */
+};
+
+static struct output outputs[MAX_OUTPUTS];
+static int output_count = 1;
+static int output_current;	/* being drawn */
+
+// variable refresh
+
+/* the id and current value of a KMS object's property, 0 if it has none */
+static uint32_t get_object_property(int fd, uint32_t obj_id, uint32_t type,
+				    const char *name, uint64_t *value)
+{
+    drmModeObjectProperties *props;
+    uint32_t i, id = 0;
+
+    props = drmModeObjectGetProperties(fd, obj_id, type);
+    if (!props)
+	return 0;
+    for (i = 0; i < props->count_props && !id; i++) {
+	drmModePropertyRes *p = drmModeGetProperty(fd, props->props[i]);
+
+	if (p && strcmp(p->name, name) == 0) {
+	    id = p->prop_id;
+	    if (value)
+		*value = props->prop_values[i];
+	}
+	drmModeFreeProperty(p);
+    }
+    drmModeFreeObjectProperties(props);
+    return id;
+}
+
+/*
+ * With variable refresh the display waits for each frame, within the
+ * panel's range, rather than showing it at the next fixed vblank, so a
+ * frame 1 ms late goes out 1 ms late instead of a whole refresh later.
+ * It is turned on when the connector is vrr_capable, unless ES_DRM_VRR=0,
+ * and the CRTC's VRR_ENABLED is set to match at modeset so an earlier
+ * process can't leave it on either.
+ */
+static void setup_vrr(struct drm *drm)
+{
+    const char *env = getenv("ES_DRM_VRR");
+    uint64_t capable = 0;
+
+    drm->has_vrr = get_object_property(drm->fd, drm->crtc_id,
+				       DRM_MODE_OBJECT_CRTC, "VRR_ENABLED",
+				       NULL) != 0;
+    drm->vrr = drm->has_vrr && !(env && strcmp(env, "0") == 0) &&
+	get_object_property(drm->fd, drm->connector_id,
+			    DRM_MODE_OBJECT_CONNECTOR, "vrr_capable",
+			    &capable) && capable;
+}
+
+// from drm-legacy
+
+static int legacy_modeset(struct drm *drm, uint32_t fb_id)
+{
+    uint32_t prop_id;
+    int ret;
+
+    ret = drmModeSetCrtc(drm->fd, drm->crtc_id, fb_id, 0, 0,
+			 &drm->connector_id, 1, drm->mode);
+    if (ret || !drm->has_vrr)
+	return ret;
+
+    /* the kernel turns this into an atomic commit for us */
+    prop_id = get_object_property(drm->fd, drm->crtc_id, DRM_MODE_OBJECT_CRTC,
+				  "VRR_ENABLED", NULL);
+    if (prop_id && drmModeObjectSetProperty(drm->fd, drm->crtc_id,
+					    DRM_MODE_OBJECT_CRTC, prop_id,
+					    drm->vrr))
+	printf("failed to set VRR_ENABLED: %s\n", strerror(errno));
+    return 0;
+}
+
+static int legacy_page_flip(struct drm *drm, uint32_t fb_id, void *data)
+{
+    return drmModePageFlip(drm->fd, drm->crtc_id, fb_id,
+			   DRM_MODE_PAGE_FLIP_EVENT, data);
+}
+
+static void setup_drm_legacy(struct drm *drm)
+{
+    drm->modeset = legacy_modeset;
+    drm->page_flip = legacy_page_flip;
+}
+
+const struct drm * init_drm_legacy(const char *device, const char *mode_str, unsigned int vrefresh)
+{
+    int ret;
+
+    ret = init_drm(&outputs[0].drm, device, mode_str, vrefresh);
+    if (ret)
+	return NULL;
+
+    setup_drm_legacy(&outputs[0].drm);
+
+    return &outputs[0].drm;
+}
+
+// from drm-atomic.c
+
+static int add_property(drmModeAtomicReq *req, uint32_t obj_id,
+			const drmModeObjectProperties *props,
+			drmModePropertyRes **props_info,
+			const char *name, uint64_t value)
+{
+    unsigned int i;
+
+    for (i = 0; i < props->count_props; i++) {
+	if (props_info[i] && strcmp(props_info[i]->name, name) == 0)
+	    return drmModeAtomicAddProperty(req, obj_id,
+					    props_info[i]->prop_id, value);
+    }
+
+    printf("no object property: %s\n", name);
+    return -EINVAL;
+}
+
+#define add_connector_property(req, drm, name, value)			\
+    add_property(req, (drm)->connector_id, (drm)->connector->props,	\
+		 (drm)->connector->props_info, name, value)
+#define add_crtc_property(req, drm, name, value)			\
+    add_property(req, (drm)->crtc_id, (drm)->crtc->props,		\
+		 (drm)->crtc->props_info, name, value)
+#define add_plane_property(req, drm, name, value)			\
+    add_property(req, (drm)->plane->plane->plane_id, (drm)->plane->props, \
+		 (drm)->plane->props_info, name, value)
+
+static drmModePropertyRes *find_property(const drmModeObjectProperties *props,
+					  drmModePropertyRes **props_info,
+					  const char *name)
+{
+    unsigned int i;
+
+    for (i = 0; i < props->count_props; i++) {
+	if (props_info[i] && strcmp(props_info[i]->name, name) == 0)
+	    return props_info[i];
+    }
+    return NULL;
+}
+
+/*
+ * An extra GL surface scanned out from its own overlay plane, so the
+ * display hardware does the composition instead of the GPU.
+ *
+ * Layer state has no commit of its own: it rides along with the main
+ * plane's next page flip, so a new image, position or alpha shows up
+ * together with the frame after the change. Only one commit can be in
+ * flight per CRTC, and a separate layer-only commit would have to wait
+ * for the same flip anyway.
+ */
+struct ESLayer {
+    struct plane plane;
+    struct gbm_surface *surface;
+    EGLSurface egl_surface;
+    int x, y, width, height;
+    int zorder;
+    float alpha;
+    ESLayerDrawFunc drawFunc;
+    void *userData;
+
+    int invalid;		/* drawFunc needs to run again */
+    int dirty;			/* plane state to go out with the next commit */
+    struct gbm_bo *bo;		/* on screen, or queued to be */
+    struct gbm_bo *next_bo;	/* drawn, waiting for the next commit */
+    struct gbm_bo *release_bo;	/* given back when the commit completes */
+    int in_fence_fd;		/* next_bo rendering done, in the fenced pipeline */
+    struct ESLayer *next;
+};
+
+#define add_layer_property(req, layer, name, value)			\
+    add_property(req, (layer)->plane.plane->plane_id, (layer)->plane.props, \
+		 (layer)->plane.props_info, name, value)
+
+/* from window pixels to CRTC pixels, as the plane scales the window */
+static int64_t layer_scale(const struct drm *drm, int pos, int dst, int dst_size,
+			   int src_size)
+{
+    if (!drm->src_w)
+	return pos;
+    return dst + (int64_t)pos * dst_size / src_size;
+}
+
+static int add_layer_properties(drmModeAtomicReq *req, struct drm *drm,
+				struct ESLayer *layer)
+{
+    struct gbm_bo *bo = layer->next_bo ? layer->next_bo : layer->bo;
+    struct drm_fb *fb = drm_fb_get_from_bo(bo);
+    int64_t x0 = layer_scale(drm, layer->x, drm->dst_x, drm->dst_w, drm->src_w);
+    int64_t y0 = layer_scale(drm, layer->y, drm->dst_y, drm->dst_h, drm->src_h);
+    int64_t x1 = layer_scale(drm, layer->x + layer->width, drm->dst_x,
+			     drm->dst_w, drm->src_w);
+    int64_t y1 = layer_scale(drm, layer->y + layer->height, drm->dst_y,
+			     drm->dst_h, drm->src_h);
+    drmModePropertyRes *p;
+
+    if (!fb ||
+	add_layer_property(req, layer, "FB_ID", fb->fb_id) < 0 ||
+	add_layer_property(req, layer, "CRTC_ID", drm->crtc_id) < 0 ||
+	add_layer_property(req, layer, "SRC_X", 0) < 0 ||
+	add_layer_property(req, layer, "SRC_Y", 0) < 0 ||
+	add_layer_property(req, layer, "SRC_W", layer->width << 16) < 0 ||
+	add_layer_property(req, layer, "SRC_H", layer->height << 16) < 0 ||
+	add_layer_property(req, layer, "CRTC_X", x0) < 0 ||
+	add_layer_property(req, layer, "CRTC_Y", y0) < 0 ||
+	add_layer_property(req, layer, "CRTC_W", x1 - x0) < 0 ||
+	add_layer_property(req, layer, "CRTC_H", y1 - y0) < 0)
+	return -EINVAL;
+
+    /* stacking and plane alpha are optional, the driver may not have them */
+    p = find_property(layer->plane.props, layer->plane.props_info, "zpos");
+    if (p && !(p->flags & DRM_MODE_PROP_IMMUTABLE) &&
+	(p->flags & DRM_MODE_PROP_RANGE) && p->count_values == 2 &&
+	add_layer_property(req, layer, "zpos",
+			   MAX2((int64_t)p->values[0],
+				MIN2((int64_t)layer->zorder,
+				     (int64_t)p->values[1]))) < 0)
+	return -EINVAL;
+
+    /* the new image is only scanned out once the GPU has finished it */
+    if (layer->next_bo && layer->in_fence_fd != -1 &&
+	add_layer_property(req, layer, "IN_FENCE_FD", layer->in_fence_fd) < 0)
+	return -EINVAL;
+
+    p = find_property(layer->plane.props, layer->plane.props_info, "alpha");
+    if (p && add_layer_property(req, layer, "alpha",
+				(uint64_t)(layer->alpha * 0xffff + 0.5f)) < 0)
+	return -EINVAL;
+
+    return 0;
+}
+
+/*
+ * Build and submit a single atomic request carrying the plane's
+ * framebuffer and position, any layers that changed, plus the
+ * connector and CRTC state when a full modeset is asked for.
+ */
+static int drm_atomic_commit(struct drm *drm, uint32_t fb_id, uint32_t flags,
+			     void *data)
+{
+    drmModeAtomicReq *req;
+    struct ESLayer *layer;
+    uint32_t blob_id = 0;
+    int ret = -EINVAL;
+
+    req = drmModeAtomicAlloc();
+    if (!req)
+	return -ENOMEM;
+
+    if (flags & DRM_MODE_ATOMIC_ALLOW_MODESET) {
+	if (add_connector_property(req, drm, "CRTC_ID", drm->crtc_id) < 0)
+	    goto out;
+
+	if (drmModeCreatePropertyBlob(drm->fd, drm->mode, sizeof(*drm->mode),
+				      &blob_id) != 0)
+	    goto out;
+
+	if (add_crtc_property(req, drm, "MODE_ID", blob_id) < 0)
+	    goto out;
+
+	if (add_crtc_property(req, drm, "ACTIVE", 1) < 0)
+	    goto out;
+    }
+
+    /* only the blocking commits at modeset touch VRR */
+    if (drm->has_vrr && !(flags & DRM_MODE_ATOMIC_NONBLOCK) &&
+	add_crtc_property(req, drm, "VRR_ENABLED", drm->vrr) < 0)
+	goto out;
+
+    if (add_plane_property(req, drm, "FB_ID", fb_id) < 0 ||
+	add_plane_property(req, drm, "CRTC_ID", drm->crtc_id) < 0 ||
+	add_plane_property(req, drm, "SRC_X", 0) < 0 ||
+	add_plane_property(req, drm, "SRC_Y", 0) < 0)
+	goto out;
+    if (drm->src_w) {
+	if (add_plane_property(req, drm, "SRC_W", (uint64_t)drm->src_w << 16) < 0 ||
+	    add_plane_property(req, drm, "SRC_H", (uint64_t)drm->src_h << 16) < 0 ||
+	    add_plane_property(req, drm, "CRTC_X", drm->dst_x) < 0 ||
+	    add_plane_property(req, drm, "CRTC_Y", drm->dst_y) < 0 ||
+	    add_plane_property(req, drm, "CRTC_W", drm->dst_w) < 0 ||
+	    add_plane_property(req, drm, "CRTC_H", drm->dst_h) < 0)
+	    goto out;
+    } else if (add_plane_property(req, drm, "SRC_W", drm->mode->hdisplay << 16) < 0 ||
+	       add_plane_property(req, drm, "SRC_H", drm->mode->vdisplay << 16) < 0 ||
+	       add_plane_property(req, drm, "CRTC_X", 0) < 0 ||
+	       add_plane_property(req, drm, "CRTC_Y", 0) < 0 ||
+	       add_plane_property(req, drm, "CRTC_W", drm->mode->hdisplay) < 0 ||
+	       add_plane_property(req, drm, "CRTC_H", drm->mode->vdisplay) < 0) {
+	goto out;
+    }
+
+    /* in the fenced pipeline KMS waits for rendering to finish, and
+     * hands back a fence that signals once the old buffer is off screen
+     */
+    if (drm->kms_in_fence_fd != -1) {
+	if (add_plane_property(req, drm, "IN_FENCE_FD", drm->kms_in_fence_fd) < 0 ||
+	    add_crtc_property(req, drm, "OUT_FENCE_PTR",
+			      (uint64_t)(uintptr_t)&drm->kms_out_fence_fd) < 0)
+	    goto out;
+    }
+
+    for (layer = drm->layers; layer; layer = layer->next) {
+	if (layer->dirty && (layer->bo || layer->next_bo) &&
+	    add_layer_properties(req, drm, layer) < 0)
+	    goto out;
+    }
+
+    ret = drmModeAtomicCommit(drm->fd, req, flags, data);
+    if (ret)
+	goto out;
+
+    /* newly drawn layers are on their way to the screen */
+    for (layer = drm->layers; layer; layer = layer->next) {
+	if (layer->next_bo) {
+	    layer->release_bo = layer->bo;
+	    layer->bo = layer->next_bo;
+	    layer->next_bo = NULL;
+	}
+	if (layer->in_fence_fd != -1) {
+	    /* the kernel holds its own reference now */
+	    close(layer->in_fence_fd);
+	    layer->in_fence_fd = -1;
+	}
+	layer->dirty = 0;
+    }
+
+out:
+    /* the CRTC keeps its own reference to the mode once committed */
+    if (blob_id)
+	drmModeDestroyPropertyBlob(drm->fd, blob_id);
+    drmModeAtomicFree(req);
+    return ret;
+}
+
+static int atomic_modeset(struct drm *drm, uint32_t fb_id)
+{
+    /* with the mode already up just swap in our plane, which the driver
+     * can do on the next vblank instead of retraining the link
+     */
+    if (drm->mode_active && drm_atomic_commit(drm, fb_id, 0, NULL) == 0)
+	return 0;
+    return drm_atomic_commit(drm, fb_id, DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+}
+
+static int atomic_page_flip(struct drm *drm, uint32_t fb_id, void *data)
+{
+    return drm_atomic_commit(drm, fb_id,
+			     DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT,
+			     data);
+}
+
+/* Pick the primary plane for our CRTC, or any plane that can drive it */
+static int get_plane_id(const struct drm *drm)
+{
+    drmModePlaneResPtr plane_resources;
+    uint32_t i, j;
+    int ret = -EINVAL;
+    int found_primary = 0;
+
+    plane_resources = drmModeGetPlaneResources(drm->fd);
+    if (!plane_resources) {
+	printf("drmModeGetPlaneResources failed: %s\n", strerror(errno));
+	return -1;
+    }
+
+    for (i = 0; (i < plane_resources->count_planes) && !found_primary; i++) {
+	uint32_t id = plane_resources->planes[i];
+	drmModePlanePtr plane = drmModeGetPlane(drm->fd, id);
+	if (!plane) {
+	    printf("drmModeGetPlane(%u) failed: %s\n", id, strerror(errno));
+	    continue;
+	}
+
+	if (plane->possible_crtcs & (1 << drm->crtc_index)) {
+	    drmModeObjectPropertiesPtr props =
+		drmModeObjectGetProperties(drm->fd, id, DRM_MODE_OBJECT_PLANE);
+
+	    /* primary or not, this plane is good enough to use: */
+	    ret = id;
+
+	    for (j = 0; props && j < props->count_props; j++) {
+		drmModePropertyPtr p = drmModeGetProperty(drm->fd, props->props[j]);
+
+		if (p && (strcmp(p->name, "type") == 0) &&
+		    (props->prop_values[j] == DRM_PLANE_TYPE_PRIMARY)) {
+		    /* found our primary plane, lets use that: */
+		    found_primary = 1;
+		}
+
+		drmModeFreeProperty(p);
+	    }
+
+	    drmModeFreeObjectProperties(props);
+	}
+
+	drmModeFreePlane(plane);
+    }
+
+    drmModeFreePlaneResources(plane_resources);
+
+    return ret;
+}
+
+/* undo whatever atomic_init_objects() got done */
+static void atomic_free_objects(struct drm *drm)
+{
+#define free_object(type, Type) do {					\
+	uint32_t i;							\
+	if (!drm->type)							\
+	    break;							\
+	for (i = 0; drm->type->props && drm->type->props_info &&	\
+		 i < drm->type->props->count_props; i++)		\
+	    drmModeFreeProperty(drm->type->props_info[i]);		\
+	free(drm->type->props_info);					\
+	if (drm->type->props)						\
+	    drmModeFreeObjectProperties(drm->type->props);		\
+	if (drm->type->type)						\
+	    drmModeFree##Type(drm->type->type);				\
+	free(drm->type);						\
+	drm->type = NULL;						\
+    } while (0)
+
+    free_object(plane, Plane);
+    free_object(crtc, Crtc);
+    free_object(connector, Connector);
+}
+
+/*
+ * Look up the plane for drm's CRTC and the property tables of the
+ * plane, CRTC and connector, and switch drm to atomic commits.
+ */
+static int atomic_init_objects(struct drm *drm)
+{
+    int plane_id;
+
+    plane_id = get_plane_id(drm);
+    if (plane_id <= 0) {
+	printf("could not find a suitable plane\n");
+	goto fail;
+    }
+
+    /* We only do single plane to single crtc to single connector, so
+     * the property tables are gathered once here and reused for every
+     * commit:
+     */
+    drm->plane = calloc(1, sizeof(*drm->plane));
+    drm->crtc = calloc(1, sizeof(*drm->crtc));
+    drm->connector = calloc(1, sizeof(*drm->connector));
+    if (!drm->plane || !drm->crtc || !drm->connector)
+	goto fail;
+
+#define get_resource(type, Type, id) do {				\
+	drm->type->type = drmModeGet##Type(drm->fd, id);		\
+	if (!drm->type->type) {						\
+	    printf("could not get %s %i: %s\n",			\
+		   #type, id, strerror(errno));				\
+	    goto fail;							\
+	}								\
+    } while (0)
+
+    get_resource(plane, Plane, plane_id);
+    get_resource(crtc, Crtc, drm->crtc_id);
+    /* init_drm() has probed it already */
+    get_resource(connector, ConnectorCurrent, drm->connector_id);
+
+#define get_properties(type, TYPE, id) do {				\
+	uint32_t i;							\
+	drm->type->props = drmModeObjectGetProperties(drm->fd,		\
+				id, DRM_MODE_OBJECT_##TYPE);		\
+	if (!drm->type->props) {					\
+	    printf("could not get %s %u properties: %s\n",		\
+		   #type, id, strerror(errno));				\
+	    goto fail;							\
+	}								\
+	drm->type->props_info = calloc(drm->type->props->count_props,	\
+				       sizeof(*drm->type->props_info));	\
+	if (!drm->type->props_info && drm->type->props->count_props)	\
+	    goto fail;							\
+	for (i = 0; i < drm->type->props->count_props; i++) {		\
+	    drm->type->props_info[i] = drmModeGetProperty(drm->fd,	\
+				drm->type->props->props[i]);		\
+	}								\
+    } while (0)
+
+    get_properties(plane, PLANE, plane_id);
+    get_properties(crtc, CRTC, drm->crtc_id);
+    get_properties(connector, CONNECTOR, drm->connector_id);
+
+    drm->modeset = atomic_modeset;
+    drm->page_flip = atomic_page_flip;
+
+    return 0;
+
+fail:
+    atomic_free_objects(drm);
+    return -1;
+}
+
+/*
+ * Switch a drm set up by init_drm() over to atomic commits. On failure
+ * it is left as it was, ready for legacy modesetting on the same fd,
+ * so falling back doesn't mean probing the connectors all over again.
+ */
+static int setup_drm_atomic(struct drm *drm)
+{
+    if (drmSetClientCap(drm->fd, DRM_CLIENT_CAP_ATOMIC, 1)) {
+	printf("no atomic modesetting support: %s\n", strerror(errno));
+	return -1;
+    }
+    if (atomic_init_objects(drm)) {
+	drmSetClientCap(drm->fd, DRM_CLIENT_CAP_ATOMIC, 0);
+	return -1;
+    }
+    return 0;
+}
+
+/*
+ * Add the other connected connectors as outputs, up to max in all,
+ * each in its default mode on a CRTC of its own. They share the fd of
+ * the first output and its choice of atomic or legacy modesetting.
+ */
+static void add_outputs(int max)
+{
+    struct drm *first = &outputs[0].drm;
+    uint32_t used_crtcs = 1u << first->crtc_index;
+    drmModeRes *resources;
+    int i, j, k;
+
+    resources = drmModeGetResources(first->fd);
+    if (!resources)
+	return;
+
+    for (i = 0; i < resources->count_connectors && output_count < max; i++) {
+	struct drm *drm = &outputs[output_count].drm;
+	drmModeConnector *connector;
+	int crtc_index = -1;
+
+	if (resources->connectors[i] == first->connector_id)
+	    continue;
+	connector = drmModeGetConnector(first->fd, resources->connectors[i]);
+	if (!connector)
+	    continue;
+	if (connector->connection != DRM_MODE_CONNECTED ||
+	    !connector->count_modes) {
+	    drmModeFreeConnector(connector);
+	    continue;
+	}
+
+	/* a CRTC that can drive the connector and isn't taken yet */
+	for (j = 0; j < connector->count_encoders && crtc_index < 0; j++) {
+	    drmModeEncoder *encoder = drmModeGetEncoder(first->fd,
+							connector->encoders[j]);
+
+	    if (!encoder)
+		continue;
+	    for (k = 0; k < resources->count_crtcs; k++) {
+		if ((encoder->possible_crtcs & (1u << k)) &&
+		    !(used_crtcs & (1u << k))) {
+		    crtc_index = k;
+		    break;
+		}
+	    }
+	    drmModeFreeEncoder(encoder);
+	}
+	if (crtc_index < 0) {
+	    printf("no free CRTC for connector %u\n", connector->connector_id);
+	    drmModeFreeConnector(connector);
+	    continue;
+	}
+
+	memset(drm, 0, sizeof(*drm));
+	drm->fd = first->fd;
+	drm->connector_id = connector->connector_id;
+	drm->crtc_id = resources->crtcs[crtc_index];
+	drm->crtc_index = crtc_index;
+	drm->mode = default_mode(connector);
+	drm->mode_active = display_mode_active(drm, connector);
+	drm->kms_in_fence_fd = -1;
+	drm->kms_out_fence_fd = -1;
+	if (first->page_flip == atomic_page_flip) {
+	    if (atomic_init_objects(drm)) {
+		drmModeFreeConnector(connector);
+		continue;
+	    }
+	} else {
+	    setup_drm_legacy(drm);
+	}
+
+	/* drm->mode points into the connector, so it stays */
+	used_crtcs |= 1u << crtc_index;
+	output_count++;
+    }
+    drmModeFreeResources(resources);
+}
+
+const struct drm * init_drm_atomic(const char *device, const char *mode_str, unsigned int vrefresh)
+{
+    struct drm *drm = &outputs[0].drm;
+
+    if (init_drm(drm, device, mode_str, vrefresh))
+	return NULL;
+
+    if (setup_drm_atomic(drm)) {
+	close(drm->fd);
+	memset(drm, 0, sizeof(*drm));
+	return NULL;
+    }
+
+    return drm;
+}
+
+/*
+ * The modifiers the primary plane can scan out the given format with,
+ * from its IN_FORMATS blob. Returns how many were put in *modifiers,
+ * which the caller frees.
+ */
+static unsigned int get_plane_modifiers(const struct drm *drm, uint32_t format,
+					uint64_t **modifiers)
+{
+    const struct drm_format_modifier_blob *blob;
+    const struct drm_format_modifier *mods;
+    const uint32_t *formats;
+    drmModePropertyBlobRes *res = NULL;
+    drmModePropertyRes *p;
+    uint64_t caps = 0;
+    unsigned int i, n = 0;
+    int fmt = -1;
+
+    *modifiers = NULL;
+    if (!drm->plane ||
+	drmGetCap(drm->fd, DRM_CAP_ADDFB2_MODIFIERS, &caps) || !caps)
+	return 0;
+
+    p = find_property(drm->plane->props, drm->plane->props_info, "IN_FORMATS");
+    for (i = 0; p && i < drm->plane->props->count_props; i++) {
+	if (drm->plane->props->props[i] == p->prop_id)
+	    res = drmModeGetPropertyBlob(drm->fd,
+					 drm->plane->props->prop_values[i]);
+    }
+    if (!res)
+	return 0;
+
+    blob = res->data;
+    formats = (const uint32_t *)((const char *)blob + blob->formats_offset);
+    mods = (const void *)((const char *)blob + blob->modifiers_offset);
+
+    for (i = 0; i < blob->count_formats; i++) {
+	if (formats[i] == format)
+	    fmt = i;
+    }
+
+    if (fmt >= 0)
+	*modifiers = calloc(blob->count_modifiers, sizeof(**modifiers));
+    for (i = 0; *modifiers && i < blob->count_modifiers; i++) {
+	/* each entry covers a window of 64 formats */
+	if (fmt >= (int)mods[i].offset && fmt < (int)mods[i].offset + 64 &&
+	    (mods[i].formats & (1ull << (fmt - mods[i].offset))))
+	    (*modifiers)[n++] = mods[i].modifier;
+    }
+
+    drmModeFreePropertyBlob(res);
+    return n;
+}
+
+/*
+ * Have the primary plane scale a width x height buffer up (or down) to
+ * the mode, so a big panel doesn't force rendering at its full size.
+ * The picture keeps its shape, letterboxed, where the driver lets the
+ * plane leave part of the CRTC bare, and is stretched over all of it
+ * where it doesn't. Each is tried with a TEST_ONLY commit of a dumb
+ * buffer of that size, before there is any GBM surface to get wrong.
+ * Returns 0 with drm->src_* and drm->dst_* set, or -1 if the plane
+ * can't do it.
+ */
+static int setup_scaling(struct drm *drm, int width, int height,
+			 uint32_t format)
+{
+    struct drm_mode_create_dumb create = {
+	.width = width, .height = height, .bpp = 32,
+    };
+    struct drm_mode_destroy_dumb destroy = { 0 };
+    uint32_t handles[4] = { 0 }, pitches[4] = { 0 }, offsets[4] = { 0 };
+    uint32_t mode_w = drm->mode->hdisplay, mode_h = drm->mode->vdisplay;
+    uint32_t flags = DRM_MODE_ATOMIC_TEST_ONLY | DRM_MODE_ATOMIC_ALLOW_MODESET;
+    uint32_t fb_id;
+    int ret = -1;
+
+    if (!drm->plane || drmIoctl(drm->fd, DRM_IOCTL_MODE_CREATE_DUMB, &create))
+	return -1;
+    handles[0] = create.handle;
+    pitches[0] = create.pitch;
+    if (drmModeAddFB2(drm->fd, width, height, format, handles, pitches,
+		      offsets, &fb_id, 0))
+	goto out;
+
+    /* the largest rectangle of the same shape, in the middle */
+    drm->src_w = width;
+    drm->src_h = height;
+    if ((uint64_t)mode_w * height > (uint64_t)mode_h * width) {
+	drm->dst_w = (uint64_t)mode_h * width / height;
+	drm->dst_h = mode_h;
+    } else {
+	drm->dst_w = mode_w;
+	drm->dst_h = (uint64_t)mode_w * height / width;
+    }
+    drm->dst_x = (mode_w - drm->dst_w) / 2;
+    drm->dst_y = (mode_h - drm->dst_h) / 2;
+    ret = drm_atomic_commit(drm, fb_id, flags, NULL);
+
+    if (ret && (drm->dst_w != mode_w || drm->dst_h != mode_h)) {
+	drm->dst_x = drm->dst_y = 0;
+	drm->dst_w = mode_w;
+	drm->dst_h = mode_h;
+	ret = drm_atomic_commit(drm, fb_id, flags, NULL);
+    }
+    drmModeRmFB(drm->fd, fb_id);
+
+out:
+    destroy.handle = create.handle;
+    drmIoctl(drm->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+    if (ret)
+	drm->src_w = drm->src_h = 0;
+    return ret ? -1 : 0;
+}
+
+// From kmscube.c
+
+#include "drm-common.h"
+
+static const struct egl *egl;
+static const struct gbm *gbm;
+static const struct drm *drm;
+
+static double get_time(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// startup tracing
+
+/*
+ * How long each step from main() to the first page flip took, printed
+ * as one line once that flip has happened.
+ */
+static struct {
+    double last;
+    const char *phase[12];
+    double ms[12];
+    int count;
+    int done;
+} startup;
+
+static void startup_mark(const char *phase)
+{
+    double now = get_time();
+
+    if (startup.done || startup.count == ARRAY_SIZE(startup.phase))
+	return;
+    if (startup.last > 0) {
+	startup.phase[startup.count] = phase;
+	startup.ms[startup.count++] = (now - startup.last) * 1000.0;
+    }
+    startup.last = now;
+}
+
+static void startup_report(void)
+{
+    double total = 0;
+    int i;
+
+    if (startup.done)
+	return;
+    startup_mark("first-flip");
+    startup.done = 1;
+
+    fprintf(stderr, "startup:");
+    for (i = 0; i < startup.count; i++) {
+	fprintf(stderr, " %s %.1f", startup.phase[i], startup.ms[i]);
+	total += startup.ms[i];
+    }
+    fprintf(stderr, " total %.1f ms\n", total);
+}
+
+static void page_flip_handler(int fd, unsigned int frame,
+			      unsigned int sec, unsigned int usec, void *data);
+static void stats_record(ESFramePhase phase, double seconds);
+
+// event loop
+
+/*
+ * Everything the main loop waits on goes through one epoll set: the
+ * DRM fd for flip events, a signalfd so SIGINT/SIGTERM end the loop
+ * cleanly, a timerfd for timed events, stdin when it is a terminal,
+ * and whatever the application adds with esRegisterFd(). Handlers
+ * run on the render thread, between frames.
+ */
+struct fd_handler {
+    int fd;
+    ESFdFunc func;
+    void *userData;
+    struct fd_handler *next;
+};
+
+static struct {
+    int epfd;
+    int signal_fd;
+    int timer_fd;
+    int quit;
+    int stdin_drain;		/* keys reach keyFunc through evdev instead */
+    ESContext *esContext;
+    struct fd_handler *handlers;
+    struct fd_handler *removed;	/* freed once dispatch is done with them */
+    sigset_t old_mask;		/* to put back at the end */
+} loop = { .epfd = -1, .signal_fd = -1, .timer_fd = -1 };
+
+static uint32_t es_to_epoll(unsigned int events)
+{
+    return ((events & ES_FD_READ) ? EPOLLIN : 0) |
+	((events & ES_FD_WRITE) ? EPOLLOUT : 0);
+}
+
+static unsigned int epoll_to_es(uint32_t events)
+{
+    return ((events & EPOLLIN) ? ES_FD_READ : 0) |
+	((events & EPOLLOUT) ? ES_FD_WRITE : 0) |
+	((events & (EPOLLERR | EPOLLHUP)) ? ES_FD_ERROR : 0);
+}
+
+static struct fd_handler *event_loop_add(int fd, unsigned int events,
+					 ESFdFunc func, void *userData)
+{
+    struct fd_handler *h = calloc(1, sizeof(*h));
+    struct epoll_event ev = { .events = es_to_epoll(events) };
+
+    if (!h)
+	return NULL;
+    h->fd = fd;
+    h->func = func;
+    h->userData = userData;
+    ev.data.ptr = h;
+
+    if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+	printf("can't watch fd %d: %s\n", fd, strerror(errno));
+	free(h);
+	return NULL;
+    }
+    h->next = loop.handlers;
+    loop.handlers = h;
+    return h;
+}
+
+static int event_loop_remove(int fd)
+{
+    struct fd_handler **hp;
+
+    for (hp = &loop.handlers; *hp; hp = &(*hp)->next) {
+	struct fd_handler *h = *hp;
+
+	if (h->fd != fd)
+	    continue;
+	epoll_ctl(loop.epfd, EPOLL_CTL_DEL, fd, NULL);
+	*hp = h->next;
+	/* an event for it may still be in the batch being dispatched */
+	h->func = NULL;
+	h->next = loop.removed;
+	loop.removed = h;
+	return 0;
+    }
+    return -1;
+}
+
+static void signal_ready(ESContext *esContext, int fd, unsigned int events,
+			 void *userData)
+{
+    struct signalfd_siginfo si;
+
+    (void)esContext, (void)events, (void)userData;
+    if (read(fd, &si, sizeof(si)) == sizeof(si))
+	printf("caught %s, exiting\n", strsignal(si.ssi_signo));
+    loop.quit = 1;
+}
+
+static void stdin_ready(ESContext *esContext, int fd, unsigned int events,
+			void *userData)
+{
+    char buf[256];
+
+    (void)esContext, (void)events, (void)userData;
+
+    /* don't leave the keys typed for the application to the shell */
+    if (loop.stdin_drain && read(fd, buf, sizeof(buf)) > 0)
+	return;
+    printf("user interrupted!\n");
+    loop.quit = 1;
+}
+
+static void drm_ready(ESContext *esContext, int fd, unsigned int events,
+		      void *userData)
+{
+    drmEventContext evctx = {
+	.version = 2,
+	.page_flip_handler = page_flip_handler,
+    };
+
+    (void)esContext, (void)events, (void)userData;
+    drmHandleEvent(fd, &evctx);
+}
+
+static int event_loop_init(ESContext *esContext)
+{
+    sigset_t mask;
+
+    loop.esContext = esContext;
+    if (loop.epfd >= 0)
+	return 0;
+
+    loop.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop.epfd < 0) {
+	printf("epoll_create1 failed: %s\n", strerror(errno));
+	return -1;
+    }
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    /* the worker and update threads inherit this, so the signals
+     * only ever arrive through the signalfd
+     */
+    pthread_sigmask(SIG_BLOCK, &mask, &loop.old_mask);
+    loop.signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (loop.signal_fd >= 0)
+	event_loop_add(loop.signal_fd, ES_FD_READ, signal_ready, NULL);
+
+    loop.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    /* keep the old "press return to quit", but only at a terminal */
+    if (isatty(0))
+	event_loop_add(0, ES_FD_READ, stdin_ready, NULL);
+
+    return 0;
+}
+
+/* Close what event_loop_init() opened; application fds stay open. */
+static void event_loop_fini(void)
+{
+    struct fd_handler *h;
+
+    if (loop.epfd < 0)
+	return;
+
+    while ((h = loop.handlers)) {
+	loop.handlers = h->next;
+	free(h);
+    }
+    while ((h = loop.removed)) {
+	loop.removed = h->next;
+	free(h);
+    }
+    if (loop.signal_fd >= 0)
+	close(loop.signal_fd);
+    pthread_sigmask(SIG_SETMASK, &loop.old_mask, NULL);
+    if (loop.timer_fd >= 0)
+	close(loop.timer_fd);
+    close(loop.epfd);
+    loop.epfd = loop.signal_fd = loop.timer_fd = -1;
+}
+
+/*
+ * Wait up to timeout ms (-1 forever) and run the handlers for any
+ * fds that are ready. Returns -1 on error or once asked to quit.
+ */
+static int event_loop_dispatch(int timeout)
+{
+    struct epoll_event events[16];
+    int n, i;
+
+    n = epoll_wait(loop.epfd, events, ARRAY_SIZE(events), timeout);
+    if (n < 0 && errno != EINTR) {
+	printf("epoll_wait err: %s\n", strerror(errno));
+	return -1;
+    }
+
+    for (i = 0; i < n; i++) {
+	struct fd_handler *h = events[i].data.ptr;
+
+	if (h->func)
+	    h->func(loop.esContext, h->fd, epoll_to_es(events[i].events),
+		    h->userData);
+    }
+
+    while (loop.removed) {
+	struct fd_handler *h = loop.removed;
+
+	loop.removed = h->next;
+	free(h);
+    }
+
+    return loop.quit ? -1 : 0;
+}
+
+///
+//  esRegisterFd()
+//
+GLboolean ESUTIL_API esRegisterFd ( ESContext *esContext, int fd, unsigned int events,
+				    ESFdFunc fdFunc, void *userData )
+{
+    if (fd < 0 || fdFunc == NULL || event_loop_init(esContext))
+	return GL_FALSE;
+
+    return event_loop_add(fd, events, fdFunc, userData) ? GL_TRUE : GL_FALSE;
+}
+
+///
+//  esUnregisterFd()
+//
+void ESUTIL_API esUnregisterFd ( ESContext *esContext, int fd )
+{
+    (void)esContext;
+    event_loop_remove(fd);
+}
+
+// headless backend
+
+/*
+ * For benchmarking without a display: render into a GBM surface on a
+ * render node, or into a pbuffer on the surfaceless EGL platform when
+ * there is no DRM device at all (e.g. llvmpipe). Nothing is scanned
+ * out; each "flip" completes straight away, optionally paced to a
+ * simulated refresh rate given by ES_DRM_HEADLESS_HZ.
+ */
+
+static double headless_period, headless_next;
+static unsigned int headless_frame;
+static EGLSyncKHR headless_fences[2];
+static void *headless_flip_data;
+
+static void headless_complete_flip(double when, void *data)
+{
+    page_flip_handler(-1, ++headless_frame, (unsigned int)when,
+		      (unsigned int)((when - (unsigned int)when) * 1e6), data);
+}
+
+/* the simulated vblank */
+static void headless_tick(ESContext *esContext, int fd, unsigned int events,
+			  void *userData)
+{
+    uint64_t expirations;
+    double tick = headless_next;
+    void *data = headless_flip_data;
+
+    (void)esContext, (void)events, (void)userData;
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations) ||
+	!data)
+	return;
+
+    headless_next = tick + headless_period;
+    headless_flip_data = NULL;
+
+    headless_complete_flip(tick, data);
+}
+
+static int headless_modeset(struct drm *drm, uint32_t fb_id)
+{
+    const char *hz = getenv("ES_DRM_HEADLESS_HZ");
+
+    (void)drm, (void)fb_id;
+    headless_period = hz && atof(hz) > 0 ? 1.0 / atof(hz) : 0;
+    headless_next = get_time() + headless_period;
+
+    if (headless_period > 0 &&
+	(loop.timer_fd < 0 ||
+	 !event_loop_add(loop.timer_fd, ES_FD_READ, headless_tick, NULL)))
+	return -1;
+    return 0;
+}
+
+static int headless_page_flip(struct drm *drm, uint32_t fb_id, void *data)
+{
+    EGLSyncKHR *fence = &headless_fences[headless_frame % ARRAY_SIZE(headless_fences)];
+
+    (void)drm, (void)fb_id;
+
+    /* A display would stop us queueing frames faster than the GPU
+     * finishes them, so allow at most two in flight.
+     */
+    if (egl->eglCreateSyncKHR && egl->eglClientWaitSyncKHR) {
+	if (*fence) {
+	    egl->eglClientWaitSyncKHR(egl->display, *fence,
+				      EGL_SYNC_FLUSH_COMMANDS_BIT_KHR,
+				      EGL_FOREVER_KHR);
+	    egl->eglDestroySyncKHR(egl->display, *fence);
+	}
+	*fence = egl->eglCreateSyncKHR(egl->display, EGL_SYNC_FENCE_KHR, NULL);
+    } else {
+	glFinish();
+    }
+
+    if (headless_period > 0) {
+	/* complete the flip from the event loop when the timer fires */
+	struct itimerspec its;
+	double now = get_time();
+
+	/* a late frame goes out on the next tick, as it would on a display */
+	while (headless_next <= now)
+	    headless_next += headless_period;
+	its = (struct itimerspec) {
+	    .it_value = {
+		.tv_sec = (time_t)headless_next,
+		.tv_nsec = (long)((headless_next - (time_t)headless_next) * 1e9),
+	    },
+	};
+
+	headless_flip_data = data;
+	return timerfd_settime(loop.timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+    }
+
+    headless_complete_flip(get_time(), data);
+    return 0;
+}
+
+static int find_render_node(void)
+{
+    drmDevicePtr devices[MAX_DRM_DEVICES] = { NULL };
+    int num_devices, fd = -1;
+
+    num_devices = drmGetDevices2(0, devices, MAX_DRM_DEVICES);
+    if (num_devices < 0)
+	return -1;
+
+    for (int i = 0; i < num_devices && fd < 0; i++) {
+	if (devices[i]->available_nodes & (1 << DRM_NODE_RENDER))
+	    fd = open(devices[i]->nodes[DRM_NODE_RENDER], O_RDWR);
+    }
+    drmFreeDevices(devices, num_devices);
+
+    return fd;
+}
+
+static EGLBoolean headless_create(ESContext *esContext, const char *device)
+{
+    struct gbm *headless_gbm = &outputs[0].gbm;
+    struct drm *hdrm = &outputs[0].drm;
+
+    memset(hdrm, 0, sizeof(*hdrm));
+    hdrm->fd = device ? open(device, O_RDWR) : find_render_node();
+    startup_mark("drm");
+    hdrm->kms_in_fence_fd = -1;
+    hdrm->kms_out_fence_fd = -1;
+    hdrm->headless = 1;
+    hdrm->modeset = headless_modeset;
+    hdrm->page_flip = headless_page_flip;
+    drm = hdrm;
+
+    if (esContext->width <= 0 || esContext->height <= 0) {
+	esContext->width = 640;
+	esContext->height = 480;
+    }
+
+    gbm = NULL;
+    if (hdrm->fd >= 0) {
+	headless_gbm->dev = gbm_create_device(hdrm->fd);
+	headless_gbm->format = window_format();
+	headless_gbm->width = esContext->width;
+	headless_gbm->height = esContext->height;
+	headless_gbm->surface = headless_gbm->dev ?
+	    gbm_surface_create(headless_gbm->dev, esContext->width, esContext->height,
+			       headless_gbm->format, GBM_BO_USE_RENDERING) : NULL;
+	if (headless_gbm->surface)
+	    gbm = headless_gbm;
+    }
+    printf("Rendering headless %dx%d %s\n", esContext->width, esContext->height,
+	   gbm ? "on a render node" : "on the surfaceless platform");
+    startup_mark("gbm");
+
+    esContext->platformData = (void *) gbm;
+
+    egl = init_egl(esContext, gbm, window_samples());
+    if (!egl)
+	return EGL_FALSE;
+    outputs[0].surface = egl->surface;
+    startup_mark("egl");
+
+    esContext->eglNativeDisplay = gbm ? (EGLNativeDisplayType) gbm->dev
+				      : EGL_DEFAULT_DISPLAY;
+    return EGL_TRUE;
+}
+
+///
+//  WinCreate()
+//
+//      This function initialized the native X11 display and window for EGL
+//
+EGLBoolean WinCreate(ESContext *esContext, const char *title)
+{
+    const char *device = getenv("ES_DRM_DEVICE");
+    const char *env_atomic = getenv("ES_DRM_ATOMIC");
+    char mode_str[DRM_DISPLAY_MODE_LEN] = "";
+    uint32_t format = window_format();
+    uint64_t linear = DRM_FORMAT_MOD_LINEAR;
+    uint64_t *modifiers = NULL;
+    unsigned int count;
+    const char *env_modifiers = getenv("ES_DRM_MODIFIERS");
+    /* atomic unless ES_DRM_ATOMIC=0, falling back to legacy if the
+     * driver can't do it
+     */
+    int atomic = !(env_atomic && strcmp(env_atomic, "0") == 0);
+    unsigned int vrefresh = 0;
+    int ret;
+    const char *env_headless = getenv("ES_DRM_HEADLESS");
+    const char *env_outputs = getenv("ES_DRM_OUTPUTS");
+    const char *env_scale = getenv("ES_DRM_SCALE");
+    /* render at the size asked for unless ES_DRM_SCALE=0 */
+    int scale = !(env_scale && strcmp(env_scale, "0") == 0) &&
+	esContext->width > 0 && esContext->height > 0;
+    struct gbm_device *dev;
+    int width, height;
+    int i;
+
+    if (env_headless && strcmp(env_headless, "0") != 0)
+	return headless_create(esContext, device);
+
+    if (init_drm(&outputs[0].drm, device, mode_str, vrefresh)) {
+	if (outputs[0].drm.fd >= 0)
+	    close(outputs[0].drm.fd);
+	/* a display that was asked for, by device or by ES_DRM_HEADLESS=0,
+	 * must not quietly turn into no output at all
+	 */
+	if (device || env_headless) {
+	    printf("failed to initialize DRM\n");
+	    return EGL_FALSE;
+	}
+	printf("no display found, rendering headless\n");
+	return headless_create(esContext, NULL);
+    }
+    drm = &outputs[0].drm;
+    if (atomic && setup_drm_atomic(&outputs[0].drm)) {
+	printf("atomic DRM not available, falling back to legacy\n");
+	atomic = 0;
+    }
+    if (!atomic)
+	setup_drm_legacy(&outputs[0].drm);
+    printf("Using %s modesetting\n", atomic ? "atomic" : "legacy");
+
+    /* ES_DRM_OUTPUTS=all drives every connected display, =N up to N */
+    if (env_outputs && *env_outputs)
+	add_outputs(strcmp(env_outputs, "all") == 0 ? MAX_OUTPUTS :
+		    MAX2(1, MIN2(atoi(env_outputs), MAX_OUTPUTS)));
+    for (i = 0; i < output_count; i++)
+	setup_vrr(&outputs[i].drm);
+    if (drm->vrr)
+	printf("Using variable refresh rate\n");
+    startup_mark("drm");
+
+    /* tiled and compressed layouts save a lot of memory bandwidth, so
+     * offer everything the plane takes unless ES_DRM_MODIFIERS=0 asks
+     * for plain linear buffers
+     */
+    dev = gbm_create_device(drm->fd);
+    for (i = 0; i < output_count; i++) {
+	struct output *o = &outputs[i];
+
+	width = o->drm.mode->hdisplay;
+	height = o->drm.mode->vdisplay;
+	if (scale && (esContext->width != width || esContext->height != height)) {
+	    if (setup_scaling(&o->drm, esContext->width, esContext->height,
+			      format) == 0) {
+		printf("Rendering %dx%d, scaled to %ux%u at %u,%u\n",
+		       esContext->width, esContext->height, o->drm.dst_w,
+		       o->drm.dst_h, o->drm.dst_x, o->drm.dst_y);
+		width = esContext->width;
+		height = esContext->height;
+	    } else {
+		printf("can't scale %dx%d to the display, rendering %dx%d\n",
+		       esContext->width, esContext->height, width, height);
+	    }
+	}
+
+	if (env_modifiers && strcmp(env_modifiers, "0") == 0) {
+	    count = 1;
+	    modifiers = &linear;
+	} else {
+	    count = get_plane_modifiers(&o->drm, format, &modifiers);
+	}
+	ret = init_gbm(&o->gbm, dev, width, height, format, modifiers, count);
+	if (modifiers != &linear)
+	    free(modifiers);
+	if (ret) {
+	    printf("failed to initialize GBM\n");
+	    if (i == 0)
+		return EGL_FALSE;
+	    output_count = i;
+	    break;
+	}
+	if (i > 0)
+	    o->x = outputs[i - 1].x + outputs[i - 1].gbm.width;
+    }
+    gbm = &outputs[0].gbm;
+    esContext->platformData = (void *) gbm;
+    /* what was really made, if the plane couldn't scale */
+    esContext->width = gbm->width;
+    esContext->height = gbm->height;
+    startup_mark("gbm");
+	
+    egl = init_egl(esContext, gbm, window_samples());
+    if (!egl)
+	return EGL_FALSE;
+    outputs[0].surface = egl->surface;
+
+    /* the other outputs are drawn with the same context */
+    for (i = 1; i < output_count; i++) {
+	outputs[i].surface = eglCreateWindowSurface(egl->display, egl->config,
+			(EGLNativeWindowType)outputs[i].gbm.surface, NULL);
+	if (outputs[i].surface == EGL_NO_SURFACE) {
+	    printf("failed to create egl surface for output %d\n", i);
+	    output_count = i;
+	    break;
+	}
+    }
+    if (output_count > 1)
+	printf("Drawing to %d outputs\n", output_count);
+    startup_mark("egl");
+
+    esContext->eglNativeDisplay = (EGLNativeDisplayType) gbm->dev;
+    return EGL_TRUE;
+}
+
+// from drm-common.c
+static void
+drm_fb_destroy_callback(struct gbm_bo *bo, void *data)
+{
+    int drm_fd = gbm_device_get_fd(gbm_bo_get_device(bo));
+    struct drm_fb *fb = data;
+
+    if (fb->fb_id)
+	drmModeRmFB(drm_fd, fb->fb_id);
+
+    free(fb);
+}
+
+struct drm_fb * drm_fb_get_from_bo(struct gbm_bo *bo)
+{
+    int drm_fd = gbm_device_get_fd(gbm_bo_get_device(bo));
+    struct drm_fb *fb = gbm_bo_get_user_data(bo);
+    uint32_t width, height, format,
+	strides[4] = {0}, handles[4] = {0},
+	offsets[4] = {0}, flags = 0;
+    int ret = -1;
+
+    if (fb)
+	return fb;
+
+    fb = calloc(1, sizeof *fb);
+    fb->bo = bo;
+
+    width = gbm_bo_get_width(bo);
+    height = gbm_bo_get_height(bo);
+    format = gbm_bo_get_format(bo);
+
+    if (gbm_bo_get_modifier && gbm_bo_get_plane_count &&
+	gbm_bo_get_stride_for_plane && gbm_bo_get_offset) {
+
+	uint64_t modifiers[4] = {0};
+	modifiers[0] = gbm_bo_get_modifier(bo);
+	const int num_planes = gbm_bo_get_plane_count(bo);
+	for (int i = 0; i < num_planes; i++) {
+	    strides[i] = gbm_bo_get_stride_for_plane(bo, i);
+	    handles[i] = gbm_bo_get_handle(bo).u32;
+	    offsets[i] = gbm_bo_get_offset(bo, i);
+	    modifiers[i] = modifiers[0];
+	}
+
+	if (modifiers[0])
+	    flags = DRM_MODE_FB_MODIFIERS;
+
+	ret = drmModeAddFB2WithModifiers(drm_fd, width, height,
+					 format, handles, strides, offsets,
+					 modifiers, &fb->fb_id, flags);
+    }
+
+    if (ret) {
+	if (flags)
+	    fprintf(stderr, "Modifiers failed!\n");
+
+	memcpy(handles, (uint32_t [4]){gbm_bo_get_handle(bo).u32,0,0,0}, 16);
+	memcpy(strides, (uint32_t [4]){gbm_bo_get_stride(bo),0,0,0}, 16);
+	memset(offsets, 0, 16);
+	ret = drmModeAddFB2(drm_fd, width, height, format,
 			    handles, strides, offsets, &fb->fb_id, 0);
     }
 
-    if (ret) {
-	printf("failed to create fb: %s\n", strerror(errno));
-	free(fb);
-	return NULL;
+    if (ret) {
+	printf("failed to create fb: %s\n", strerror(errno));
+	free(fb);
+	return NULL;
+    }
+
+    gbm_bo_set_user_data(bo, fb, drm_fb_destroy_callback);
+
+    return fb;
+}
+
+// from drm-legacy.c
+
+static void page_flip_handler(int fd, unsigned int frame,
+			      unsigned int sec, unsigned int usec, void *data)
+{
+    /* suppress 'unused parameter' warnings */
+    (void)fd;
+
+    struct output *output = data;
+    struct flip *flip = &output->flip;
+    struct ESLayer *layer;
+    /* some drivers don't timestamp their events */
+    double time = (sec || usec) ? sec + usec * 1e-6 : get_time();
+
+    /* how often frames reach the screen: with VRR, the refresh rate */
+    if (output == outputs && flip->completed)
+	stats_record(ES_PHASE_PRESENT, time - flip->time);
+    if (flip->input_time) {
+	stats_record(ES_PHASE_LATENCY, time - flip->input_time);
+	flip->input_time = 0;
+    }
+
+    flip->frame = frame;
+    flip->completed++;
+    flip->time = time;
+
+    if (flip->release_bo) {
+	gbm_surface_release_buffer(flip->surface, flip->release_bo);
+	flip->release_bo = NULL;
+    }
+    for (layer = output->drm.layers; layer; layer = layer->next) {
+	if (layer->release_bo) {
+	    gbm_surface_release_buffer(layer->surface, layer->release_bo);
+	    layer->release_bo = NULL;
+	}
+    }
+    flip->waiting = 0;
+}
+
+/*
+ * Run the event loop until the pending flip has completed or, if
+ * block is 0, just handle whatever events have already arrived.
+ */
+static int wait_for_flip(struct flip *flip, int block)
+{
+    do {
+	if (event_loop_dispatch(block && flip->waiting ? -1 : 0))
+	    return -1;
+    } while (block && flip->waiting);
+
+    if (flip->completed)
+	startup_report();
+
+    return 0;
+}
+
+// from drm-atomic.c, atomic_run()
+
+static EGLSyncKHR create_fence(const struct egl *egl, int fd)
+{
+    EGLint attrib_list[] = {
+	EGL_SYNC_NATIVE_FENCE_FD_ANDROID, fd,
+	EGL_NONE,
+    };
+
+    return egl->eglCreateSyncKHR(egl->display, EGL_SYNC_NATIVE_FENCE_ANDROID,
+				 attrib_list);
+}
+
+// overlay layers
+
+/*
+ * Layers are drawn with their own context, sharing objects with the
+ * application's, since they need a config with alpha for a format
+ * like ARGB8888 that the overlay planes can blend.
+ */
+static EGLConfig layer_config;
+static EGLContext layer_context = EGL_NO_CONTEXT;
+
+static int layer_init_egl(void)
+{
+    static const EGLint context_attribs[] = {
+	EGL_CONTEXT_CLIENT_VERSION, 3,
+	EGL_NONE
+    };
+    static const EGLint config_attribs[] = {
+	EGL_SURFACE_TYPE, EGL_WINDOW_BIT,
+	EGL_RED_SIZE, 1,
+	EGL_GREEN_SIZE, 1,
+	EGL_BLUE_SIZE, 1,
+	EGL_ALPHA_SIZE, 1,
+	EGL_RENDERABLE_TYPE, EGL_OPENGL_ES3_BIT_KHR,
+	EGL_NONE
+    };
+
+    if (layer_context != EGL_NO_CONTEXT)
+	return 0;
+
+    if (!egl_choose_config(egl->display, config_attribs, DRM_FORMAT_ARGB8888,
+			   &layer_config)) {
+	printf("no ARGB8888 config for layers\n");
+	return -1;
+    }
+    layer_context = eglCreateContext(egl->display, layer_config,
+				     egl->context, context_attribs);
+    if (layer_context == EGL_NO_CONTEXT) {
+	printf("failed to create layer context\n");
+	return -1;
+    }
+    return 0;
+}
+
+static int plane_in_use(const struct drm *drm, uint32_t plane_id)
+{
+    const struct ESLayer *layer;
+
+    if (drm->plane && drm->plane->plane->plane_id == plane_id)
+	return 1;
+    for (layer = drm->layers; layer; layer = layer->next) {
+	if (layer->plane.plane->plane_id == plane_id)
+	    return 1;
+    }
+    return 0;
+}
+
+/* A free overlay plane on our CRTC that can scan out ARGB8888 */
+static int get_overlay_plane(const struct drm *drm, struct plane *out)
+{
+    drmModePlaneResPtr plane_resources;
+    uint32_t i, j;
+
+    plane_resources = drmModeGetPlaneResources(drm->fd);
+    if (!plane_resources) {
+	printf("drmModeGetPlaneResources failed: %s\n", strerror(errno));
+	return -1;
+    }
+
+    for (i = 0; i < plane_resources->count_planes && !out->plane; i++) {
+	uint32_t id = plane_resources->planes[i];
+	drmModePlanePtr plane;
+	drmModeObjectPropertiesPtr props;
+	drmModePropertyRes **props_info;
+	drmModePropertyRes *type;
+	int argb = 0;
+
+	if (plane_in_use(drm, id))
+	    continue;
+	plane = drmModeGetPlane(drm->fd, id);
+	if (!plane)
+	    continue;
+	for (j = 0; j < plane->count_formats; j++)
+	    argb |= plane->formats[j] == DRM_FORMAT_ARGB8888;
+	if (!argb || !(plane->possible_crtcs & (1 << drm->crtc_index))) {
+	    drmModeFreePlane(plane);
+	    continue;
+	}
+
+	props = drmModeObjectGetProperties(drm->fd, id, DRM_MODE_OBJECT_PLANE);
+	if (!props) {
+	    drmModeFreePlane(plane);
+	    continue;
+	}
+	props_info = calloc(props->count_props, sizeof(*props_info));
+	for (j = 0; j < props->count_props; j++)
+	    props_info[j] = drmModeGetProperty(drm->fd, props->props[j]);
+
+	type = find_property(props, props_info, "type");
+	for (j = 0; type && j < props->count_props; j++) {
+	    if (props->props[j] == type->prop_id &&
+		props->prop_values[j] == DRM_PLANE_TYPE_OVERLAY) {
+		out->plane = plane;
+		out->props = props;
+		out->props_info = props_info;
+	    }
+	}
+
+	if (!out->plane) {
+	    for (j = 0; j < props->count_props; j++)
+		drmModeFreeProperty(props_info[j]);
+	    free(props_info);
+	    drmModeFreeObjectProperties(props);
+	    drmModeFreePlane(plane);
+	}
+    }
+
+    drmModeFreePlaneResources(plane_resources);
+
+    return out->plane ? 0 : -1;
+}
+
+static void free_plane(struct plane *plane)
+{
+    uint32_t i;
+
+    for (i = 0; i < plane->props->count_props; i++)
+	drmModeFreeProperty(plane->props_info[i]);
+    free(plane->props_info);
+    drmModeFreeObjectProperties(plane->props);
+    drmModeFreePlane(plane->plane);
+}
+
+/*
+ * Draw the layers that have been invalidated, each into a new buffer
+ * that goes out with the next page flip. Layers nobody touched cost
+ * nothing: the display keeps scanning out their old buffer.
+ */
+static void draw_layers(ESContext *esContext, int fenced)
+{
+    struct ESLayer *layer;
+    int drawn = 0;
+
+    for (layer = outputs[0].drm.layers; layer; layer = layer->next) {
+	/* the last drawing has to reach the screen first */
+	if (!layer->invalid || layer->next_bo ||
+	    !gbm_surface_has_free_buffers(layer->surface))
+	    continue;
+
+	eglMakeCurrent(egl->display, layer->egl_surface, layer->egl_surface,
+		       layer_context);
+	glViewport(0, 0, layer->width, layer->height);
+	layer->drawFunc(esContext, layer->userData);
+	if (fenced) {
+	    /* as for the main plane, KMS waits on this instead of us */
+	    EGLSyncKHR gpu_fence = create_fence(egl, EGL_NO_NATIVE_FENCE_FD_ANDROID);
+
+	    eglSwapBuffers(egl->display, layer->egl_surface);
+	    if (gpu_fence) {
+		layer->in_fence_fd = egl->eglDupNativeFenceFDANDROID(egl->display,
+								     gpu_fence);
+		egl->eglDestroySyncKHR(egl->display, gpu_fence);
+	    }
+	} else {
+	    eglSwapBuffers(egl->display, layer->egl_surface);
+	}
+	drawn = 1;
+
+	layer->next_bo = gbm_surface_lock_front_buffer(layer->surface);
+	if (layer->next_bo && !drm_fb_get_from_bo(layer->next_bo)) {
+	    gbm_surface_release_buffer(layer->surface, layer->next_bo);
+	    layer->next_bo = NULL;
+	}
+	if (!layer->next_bo && layer->in_fence_fd != -1) {
+	    close(layer->in_fence_fd);
+	    layer->in_fence_fd = -1;
+	}
+	if (layer->next_bo) {
+	    layer->invalid = 0;
+	    layer->dirty = 1;
+	}
+    }
+
+    if (drawn)
+	eglMakeCurrent(egl->display, outputs[0].surface, outputs[0].surface,
+		       egl->context);
+}
+
+///
+//  esCreateLayer()
+//
+ESLayer *ESUTIL_API esCreateLayer ( ESContext *esContext, GLint x, GLint y,
+				    GLint width, GLint height, GLint zorder,
+				    ESLayerDrawFunc drawFunc, void *userData )
+{
+    struct drm *ldrm = &outputs[0].drm;
+    struct gbm *lgbm = (struct gbm *) esContext->platformData;
+    struct ESLayer *layer;
+
+    if (ldrm->headless || ldrm->page_flip != atomic_page_flip || !lgbm) {
+	printf("layers need atomic modesetting\n");
+	return NULL;
+    }
+    if (width <= 0 || height <= 0 || drawFunc == NULL || layer_init_egl())
+	return NULL;
+
+    layer = calloc(1, sizeof(*layer));
+    if (!layer)
+	return NULL;
+
+    if (get_overlay_plane(ldrm, &layer->plane)) {
+	printf("no free overlay plane for a layer\n");
+	free(layer);
+	return NULL;
+    }
+
+    layer->surface = gbm_surface_create(lgbm->dev, width, height,
+					DRM_FORMAT_ARGB8888,
+					GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING);
+    layer->egl_surface = layer->surface ?
+	eglCreateWindowSurface(egl->display, layer_config,
+			       (EGLNativeWindowType)layer->surface, NULL) :
+	EGL_NO_SURFACE;
+    if (layer->egl_surface == EGL_NO_SURFACE) {
+	printf("failed to create layer surface\n");
+	if (layer->surface)
+	    gbm_surface_destroy(layer->surface);
+	free_plane(&layer->plane);
+	free(layer);
+	return NULL;
+    }
+
+    layer->x = x;
+    layer->y = y;
+    layer->width = width;
+    layer->height = height;
+    layer->zorder = zorder;
+    layer->alpha = 1.0f;
+    layer->drawFunc = drawFunc;
+    layer->userData = userData;
+    layer->invalid = 1;
+    layer->in_fence_fd = -1;
+
+    layer->next = ldrm->layers;
+    ldrm->layers = layer;
+
+    printf("Layer %dx%d on plane %u\n", width, height,
+	   layer->plane.plane->plane_id);
+    return layer;
+}
+
+///
+//  esSetLayerPosition()
+//
+void ESUTIL_API esSetLayerPosition ( ESLayer *layer, GLint x, GLint y )
+{
+    layer->x = x;
+    layer->y = y;
+    layer->dirty = 1;
+}
+
+///
+//  esSetLayerAlpha()
+//
+void ESUTIL_API esSetLayerAlpha ( ESLayer *layer, GLfloat alpha )
+{
+    layer->alpha = MAX2(0.0f, MIN2(alpha, 1.0f));
+    layer->dirty = 1;
+}
+
+///
+//  esInvalidateLayer()
+//
+void ESUTIL_API esInvalidateLayer ( ESLayer *layer )
+{
+    layer->invalid = 1;
+}
+
+///
+//  esDestroyLayer()
+//
+void ESUTIL_API esDestroyLayer ( ESLayer *layer )
+{
+    struct drm *ldrm = &outputs[0].drm;
+    struct ESLayer **lp;
+
+    for (lp = &ldrm->layers; *lp && *lp != layer; lp = &(*lp)->next)
+	;
+    if (!*lp)
+	return;
+    *lp = layer->next;
+
+    if (layer->bo) {
+	/* a blocking commit, so the plane is off before its buffers go */
+	drmModeAtomicReq *req = drmModeAtomicAlloc();
+
+	if (req) {
+	    add_layer_property(req, layer, "FB_ID", 0);
+	    add_layer_property(req, layer, "CRTC_ID", 0);
+	    if (drmModeAtomicCommit(ldrm->fd, req, 0, NULL))
+		printf("failed to disable layer plane: %s\n", strerror(errno));
+	    drmModeAtomicFree(req);
+	}
+    }
+
+    if (layer->release_bo)
+	gbm_surface_release_buffer(layer->surface, layer->release_bo);
+    if (layer->next_bo)
+	gbm_surface_release_buffer(layer->surface, layer->next_bo);
+    if (layer->bo)
+	gbm_surface_release_buffer(layer->surface, layer->bo);
+    if (layer->in_fence_fd != -1)
+	close(layer->in_fence_fd);
+    eglDestroySurface(egl->display, layer->egl_surface);
+    gbm_surface_destroy(layer->surface);
+    free_plane(&layer->plane);
+    free(layer);
+}
+
+// dma-buf import
+
+/*
+ * Frames from decoders and cameras arrive as dma-bufs. Rather than
+ * copying them into textures they are wrapped as EGLImages, and as
+ * producers cycle through a small set of buffers each is imported
+ * once and looked up again by its inode, which stays the same however
+ * many times the fd is dup'ed or passed around.
+ *
+ * Before Linux 5.3 every dma-buf shares the one anonymous inode, so
+ * there the cache is off and each frame is imported afresh; the
+ * texture keeps the buffer alive after the EGLImage goes.
+ */
+#define DMABUF_CACHE_SIZE 16
+
+struct dmabuf_image {
+    dev_t dev;
+    ino_t ino;			/* 0 when the slot is free */
+    uint32_t fourcc;
+    uint32_t offset;
+    int width, height;
+    EGLImageKHR image[3];	/* the whole YUV image, then one per plane */
+    unsigned int last_used;
+};
+
+static struct dmabuf_image dmabuf_cache[DMABUF_CACHE_SIZE];
+static struct dmabuf_image dmabuf_uncached;
+static unsigned int dmabuf_clock;
+
+static void dmabuf_cache_free(struct dmabuf_image *c)
+{
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE(c->image); i++) {
+	if (c->image[i])
+	    egl->eglDestroyImageKHR(egl->display, c->image[i]);
+    }
+    memset(c, 0, sizeof(*c));
+}
+
+/* whether st is a dma-buf inode of its own, not the shared anonymous one */
+static int dmabuf_inode_unique(const struct stat *st)
+{
+    static int anon_known;
+    static struct stat anon;
+    int fd;
+
+    /* eventfds are always on the anonymous inode */
+    if (!anon_known) {
+	fd = eventfd(0, EFD_CLOEXEC);
+	if (fd < 0 || fstat(fd, &anon) < 0)
+	    memset(&anon, 0, sizeof(anon));
+	if (fd >= 0)
+	    close(fd);
+	anon_known = 1;
+	if (anon.st_ino == st->st_ino && anon.st_dev == st->st_dev)
+	    printf("dma-bufs share one inode, importing every frame\n");
+    }
+    return anon.st_ino != st->st_ino || anon.st_dev != st->st_dev;
+}
+
+static struct dmabuf_image *dmabuf_cache_get(const ESDmaBuf *buf)
+{
+    struct dmabuf_image *c, *victim = &dmabuf_cache[0];
+    struct stat st;
+    unsigned int i;
+
+    if (fstat(buf->fd[0], &st) < 0)
+	return NULL;
+
+    if (!dmabuf_inode_unique(&st)) {
+	dmabuf_cache_free(&dmabuf_uncached);
+	return &dmabuf_uncached;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(dmabuf_cache); i++) {
+	c = &dmabuf_cache[i];
+	if (c->ino == st.st_ino && c->dev == st.st_dev &&
+	    c->fourcc == buf->fourcc &&
+	    c->offset == buf->offset[0] &&
+	    c->width == buf->width && c->height == buf->height) {
+	    c->last_used = ++dmabuf_clock;
+	    return c;
+	}
+	if (c->last_used < victim->last_used)
+	    victim = c;
+    }
+
+    dmabuf_cache_free(victim);
+    victim->dev = st.st_dev;
+    victim->ino = st.st_ino;
+    victim->fourcc = buf->fourcc;
+    victim->offset = buf->offset[0];
+    victim->width = buf->width;
+    victim->height = buf->height;
+    victim->last_used = ++dmabuf_clock;
+    return victim;
+}
+
+/*
+ * Import planes [first, first + count) of buf as one EGLImage of the
+ * given fourcc and size.
+ */
+static EGLImageKHR dmabuf_import(const ESDmaBuf *buf, uint32_t fourcc,
+				 int width, int height, int first, int count)
+{
+    static const EGLint plane_attribs[4][5] = {
+	{ EGL_DMA_BUF_PLANE0_FD_EXT, EGL_DMA_BUF_PLANE0_OFFSET_EXT,
+	  EGL_DMA_BUF_PLANE0_PITCH_EXT, EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT,
+	  EGL_DMA_BUF_PLANE0_MODIFIER_HI_EXT },
+	{ EGL_DMA_BUF_PLANE1_FD_EXT, EGL_DMA_BUF_PLANE1_OFFSET_EXT,
+	  EGL_DMA_BUF_PLANE1_PITCH_EXT, EGL_DMA_BUF_PLANE1_MODIFIER_LO_EXT,
+	  EGL_DMA_BUF_PLANE1_MODIFIER_HI_EXT },
+	{ EGL_DMA_BUF_PLANE2_FD_EXT, EGL_DMA_BUF_PLANE2_OFFSET_EXT,
+	  EGL_DMA_BUF_PLANE2_PITCH_EXT, EGL_DMA_BUF_PLANE2_MODIFIER_LO_EXT,
+	  EGL_DMA_BUF_PLANE2_MODIFIER_HI_EXT },
+	{ EGL_DMA_BUF_PLANE3_FD_EXT, EGL_DMA_BUF_PLANE3_OFFSET_EXT,
+	  EGL_DMA_BUF_PLANE3_PITCH_EXT, EGL_DMA_BUF_PLANE3_MODIFIER_LO_EXT,
+	  EGL_DMA_BUF_PLANE3_MODIFIER_HI_EXT },
+    };
+    EGLint attribs[7 + 4 * 10];
+    EGLImageKHR image;
+    int n = 0, i;
+
+    attribs[n++] = EGL_WIDTH;
+    attribs[n++] = width;
+    attribs[n++] = EGL_HEIGHT;
+    attribs[n++] = height;
+    attribs[n++] = EGL_LINUX_DRM_FOURCC_EXT;
+    attribs[n++] = fourcc;
+
+    for (i = 0; i < count; i++) {
+	const int p = first + i;
+
+	attribs[n++] = plane_attribs[i][0];
+	attribs[n++] = buf->fd[p] >= 0 ? buf->fd[p] : buf->fd[0];
+	attribs[n++] = plane_attribs[i][1];
+	attribs[n++] = buf->offset[p];
+	attribs[n++] = plane_attribs[i][2];
+	attribs[n++] = buf->pitch[p];
+	if (egl->modifiers_supported &&
+	    buf->modifier != DRM_FORMAT_MOD_INVALID) {
+	    attribs[n++] = plane_attribs[i][3];
+	    attribs[n++] = buf->modifier & 0xffffffff;
+	    attribs[n++] = plane_attribs[i][4];
+	    attribs[n++] = buf->modifier >> 32;
+	}
+    }
+    attribs[n] = EGL_NONE;
+
+    image = egl->eglCreateImageKHR(egl->display, EGL_NO_CONTEXT,
+				   EGL_LINUX_DMA_BUF_EXT, NULL, attribs);
+    if (!image)
+	printf("failed to import dma-buf as %.4s: 0x%x\n",
+	       (const char *)&fourcc, eglGetError());
+    return image;
+}
+
+static int dmabuf_supported(void)
+{
+    static int supported = -1;
+
+    if (supported < 0) {
+	supported = egl->eglCreateImageKHR && egl->glEGLImageTargetTexture2DOES &&
+	    has_ext(eglQueryString(egl->display, EGL_EXTENSIONS),
+		    "EGL_EXT_image_dma_buf_import");
+	if (!supported)
+	    printf("no EGL_EXT_image_dma_buf_import or GL_OES_EGL_image\n");
+    }
+    return supported;
+}
+
+///
+//  esBindDmaBufExternal()
+//
+GLboolean ESUTIL_API esBindDmaBufExternal ( ESContext *esContext, const ESDmaBuf *buf,
+					    GLuint texture )
+{
+    struct dmabuf_image *c;
+
+    (void)esContext;
+    if (!dmabuf_supported() || buf->planes < 1 || buf->planes > 4)
+	return GL_FALSE;
+
+    c = dmabuf_cache_get(buf);
+    if (!c)
+	return GL_FALSE;
+    if (!c->image[0])
+	c->image[0] = dmabuf_import(buf, buf->fourcc, buf->width, buf->height,
+				    0, buf->planes);
+    if (!c->image[0])
+	return GL_FALSE;
+
+    glBindTexture(GL_TEXTURE_EXTERNAL_OES, texture);
+    egl->glEGLImageTargetTexture2DOES(GL_TEXTURE_EXTERNAL_OES, c->image[0]);
+    return GL_TRUE;
+}
+
+///
+//  esBindDmaBufPlanes()
+//
+GLboolean ESUTIL_API esBindDmaBufPlanes ( ESContext *esContext, const ESDmaBuf *buf,
+					  const GLuint textures[2] )
+{
+    static const uint32_t plane_formats[2] = {
+	DRM_FORMAT_R8, DRM_FORMAT_GR88
+    };
+    struct dmabuf_image *c;
+    int i;
+
+    (void)esContext;
+    if (!dmabuf_supported())
+	return GL_FALSE;
+    if (buf->fourcc != DRM_FORMAT_NV12 || buf->planes != 2) {
+	printf("only NV12 can be imported a plane at a time\n");
+	return GL_FALSE;
+    }
+
+    c = dmabuf_cache_get(buf);
+    if (!c)
+	return GL_FALSE;
+
+    for (i = 0; i < 2; i++) {
+	/* chroma is subsampled by two in both directions */
+	if (!c->image[i + 1])
+	    c->image[i + 1] = dmabuf_import(buf, plane_formats[i],
+					    buf->width >> i, buf->height >> i,
+					    i, 1);
+	if (!c->image[i + 1])
+	    return GL_FALSE;
+
+	glBindTexture(GL_TEXTURE_2D, textures[i]);
+	egl->glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, c->image[i + 1]);
+    }
+    return GL_TRUE;
+}
+
+///
+//  esReleaseDmaBuf()
+//
+void ESUTIL_API esReleaseDmaBuf ( ESContext *esContext, int fd )
+{
+    struct stat st;
+    unsigned int i;
+
+    (void)esContext;
+    if (fstat(fd, &st) < 0)
+	return;
+    for (i = 0; i < ARRAY_SIZE(dmabuf_cache); i++) {
+	if (dmabuf_cache[i].ino == st.st_ino && dmabuf_cache[i].dev == st.st_dev)
+	    dmabuf_cache_free(&dmabuf_cache[i]);
+    }
+}
+
+/*
+ * A stand-in for a hardware decoder: raw NV12 frames read from a file
+ * into a ring of linear GBM buffers, handed out as dma-bufs. The ring
+ * is deep enough that a buffer is not rewritten while a queued frame
+ * may still be sampling it.
+ */
+#define VIDEO_FILE_BUFFERS 4
+
+struct ESVideoFile {
+    ESContext *esContext;
+    FILE *file;
+    int width, height;
+    struct gbm_bo *bo[VIDEO_FILE_BUFFERS];
+    ESDmaBuf buf[VIDEO_FILE_BUFFERS];
+    unsigned int next;
+};
+
+///
+//  esOpenVideoFile()
+//
+ESVideoFile *ESUTIL_API esOpenVideoFile ( ESContext *esContext, const char *filename,
+					  GLint width, GLint height )
+{
+    struct gbm *vgbm = (struct gbm *) esContext->platformData;
+    struct ESVideoFile *video;
+    int i;
+
+    if (!vgbm) {
+	printf("video needs a GBM device\n");
+	return NULL;
+    }
+    if (width <= 0 || height <= 0 || (width | height) & 1) {
+	printf("bad NV12 frame size %dx%d\n", width, height);
+	return NULL;
+    }
+
+    video = calloc(1, sizeof(*video));
+    if (!video)
+	return NULL;
+    video->esContext = esContext;
+    video->width = width;
+    video->height = height;
+    for (i = 0; i < VIDEO_FILE_BUFFERS; i++)
+	video->buf[i].fd[0] = -1;
+
+    video->file = fopen(filename, "rb");
+    if (!video->file) {
+	printf("can't open %s: %s\n", filename, strerror(errno));
+	esCloseVideoFile(video);
+	return NULL;
+    }
+
+    for (i = 0; i < VIDEO_FILE_BUFFERS; i++) {
+	ESDmaBuf *buf = &video->buf[i];
+	uint32_t stride;
+
+	/* one R8 buffer tall enough for Y with the UV plane below it */
+	video->bo[i] = gbm_bo_create(vgbm->dev, width, height * 3 / 2,
+				     DRM_FORMAT_R8, GBM_BO_USE_LINEAR);
+	if (!video->bo[i]) {
+	    printf("failed to allocate video buffer\n");
+	    esCloseVideoFile(video);
+	    return NULL;
+	}
+	stride = gbm_bo_get_stride(video->bo[i]);
+
+	buf->width = width;
+	buf->height = height;
+	buf->fourcc = DRM_FORMAT_NV12;
+	buf->planes = 2;
+	buf->fd[0] = gbm_bo_get_fd(video->bo[i]);
+	buf->fd[1] = -1;
+	buf->offset[1] = stride * height;
+	buf->pitch[0] = buf->pitch[1] = stride;
+	buf->modifier = DRM_FORMAT_MOD_LINEAR;
+    }
+
+    return video;
+}
+
+///
+//  esVideoFileFrame()
+//
+const ESDmaBuf *ESUTIL_API esVideoFileFrame ( ESVideoFile *video )
+{
+    struct gbm_bo *bo = video->bo[video->next];
+    ESDmaBuf *buf = &video->buf[video->next];
+    uint32_t stride;
+    void *map_data = NULL;
+    uint8_t *map;
+    int rows = video->height * 3 / 2;
+    int y;
+
+    map = gbm_bo_map(bo, 0, 0, video->width, rows, GBM_BO_TRANSFER_WRITE,
+		     &stride, &map_data);
+    if (!map) {
+	printf("failed to map video buffer\n");
+	return NULL;
+    }
+
+    for (y = 0; y < rows; y++) {
+	if (fread(map + y * stride, video->width, 1, video->file) == 1)
+	    continue;
+	if (y == 0 && fseek(video->file, 0, SEEK_SET) == 0 &&
+	    fread(map, video->width, 1, video->file) == 1)
+	    continue;	/* looped back to the first frame */
+	gbm_bo_unmap(bo, map_data);
+	printf("short read from video file\n");
+	return NULL;
+    }
+    gbm_bo_unmap(bo, map_data);
+
+    video->next = (video->next + 1) % VIDEO_FILE_BUFFERS;
+    return buf;
+}
+
+///
+//  esCloseVideoFile()
+//
+void ESUTIL_API esCloseVideoFile ( ESVideoFile *video )
+{
+    int i;
+
+    for (i = 0; i < VIDEO_FILE_BUFFERS; i++) {
+	if (video->buf[i].fd[0] >= 0) {
+	    esReleaseDmaBuf(video->esContext, video->buf[i].fd[0]);
+	    close(video->buf[i].fd[0]);
+	}
+	if (video->bo[i])
+	    gbm_bo_destroy(video->bo[i]);
+    }
+    if (video->file)
+	fclose(video->file);
+    free(video);
+}
+
+// V4L2 capture
+
+/*
+ * Capture buffers are exported as dma-bufs and go through the same
+ * EGLImage cache as video, so each is imported once and frames reach
+ * the GPU without a copy. A buffer goes back to the driver only once
+ * a fence shows the GPU has finished sampling it.
+ */
+#define CAPTURE_BUFFERS 4
+
+enum capture_state {
+    CAPTURE_QUEUED,		/* owned by the driver */
+    CAPTURE_READY,		/* filled, not yet handed out */
+    CAPTURE_IN_USE,		/* returned by the last esCaptureFrame() */
+    CAPTURE_RELEASING,		/* waiting for the GPU to finish with it */
+};
+
+struct capture_buffer {
+    ESDmaBuf buf;
+    enum capture_state state;
+    EGLSyncKHR fence;
+};
+
+struct ESCapture {
+    ESContext *esContext;
+    int fd;
+    unsigned int count;
+    struct capture_buffer buffers[CAPTURE_BUFFERS];
+    int ready;			/* newest filled buffer, or -1 */
+    int in_use;			/* buffer the application has, or -1 */
+};
+
+static int capture_queue(struct ESCapture *cap, int i)
+{
+    struct v4l2_buffer vbuf = {
+	.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+	.memory = V4L2_MEMORY_MMAP,
+	.index = i,
+    };
+
+    if (ioctl(cap->fd, VIDIOC_QBUF, &vbuf) < 0) {
+	printf("VIDIOC_QBUF failed: %s\n", strerror(errno));
+	return -1;
+    }
+    cap->buffers[i].state = CAPTURE_QUEUED;
+    return 0;
+}
+
+/* give back the buffers the GPU is done with */
+static void capture_recycle(struct ESCapture *cap)
+{
+    unsigned int i;
+
+    for (i = 0; i < cap->count; i++) {
+	struct capture_buffer *b = &cap->buffers[i];
+
+	if (b->state != CAPTURE_RELEASING)
+	    continue;
+	if (b->fence) {
+	    if (egl->eglClientWaitSyncKHR(egl->display, b->fence, 0, 0) ==
+		EGL_TIMEOUT_EXPIRED_KHR)
+		continue;
+	    egl->eglDestroySyncKHR(egl->display, b->fence);
+	    b->fence = NULL;
+	}
+	capture_queue(cap, i);
+    }
+}
+
+static void capture_ready(ESContext *esContext, int fd, unsigned int events,
+			  void *userData)
+{
+    struct ESCapture *cap = userData;
+    struct v4l2_buffer vbuf = {
+	.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+	.memory = V4L2_MEMORY_MMAP,
+    };
+
+    (void)esContext, (void)events;
+    while (ioctl(fd, VIDIOC_DQBUF, &vbuf) == 0) {
+	/* a frame nobody looked at is overtaken, straight back it goes */
+	if (cap->ready >= 0)
+	    capture_queue(cap, cap->ready);
+	cap->ready = vbuf.index;
+	cap->buffers[vbuf.index].state = CAPTURE_READY;
+    }
+    if (errno != EAGAIN)
+	printf("VIDIOC_DQBUF failed: %s\n", strerror(errno));
+
+    capture_recycle(cap);
+}
+
+///
+//  esOpenCapture()
+//
+ESCapture *ESUTIL_API esOpenCapture ( ESContext *esContext, const char *device,
+				      GLint width, GLint height, GLuint fourcc )
+{
+    struct ESCapture *cap;
+    struct v4l2_capability caps;
+    struct v4l2_format fmt = { .type = V4L2_BUF_TYPE_VIDEO_CAPTURE };
+    struct v4l2_requestbuffers req = {
+	.count = CAPTURE_BUFFERS,
+	.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+	.memory = V4L2_MEMORY_MMAP,
+    };
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    unsigned int i;
+
+    cap = calloc(1, sizeof(*cap));
+    if (!cap)
+	return NULL;
+    cap->esContext = esContext;
+    cap->ready = cap->in_use = -1;
+    for (i = 0; i < CAPTURE_BUFFERS; i++)
+	cap->buffers[i].buf.fd[0] = -1;
+
+    cap->fd = open(device, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (cap->fd < 0) {
+	printf("can't open %s: %s\n", device, strerror(errno));
+	free(cap);
+	return NULL;
+    }
+
+    if (ioctl(cap->fd, VIDIOC_QUERYCAP, &caps) < 0 ||
+	!(caps.device_caps & V4L2_CAP_VIDEO_CAPTURE) ||
+	!(caps.device_caps & V4L2_CAP_STREAMING)) {
+	printf("%s is not a streaming capture device\n", device);
+	goto fail;
+    }
+
+    /* V4L2 and DRM share the fourccs of the common YUV formats */
+    fmt.fmt.pix.width = width;
+    fmt.fmt.pix.height = height;
+    fmt.fmt.pix.pixelformat = fourcc;
+    fmt.fmt.pix.field = V4L2_FIELD_NONE;
+    if (ioctl(cap->fd, VIDIOC_S_FMT, &fmt) < 0) {
+	printf("VIDIOC_S_FMT failed: %s\n", strerror(errno));
+	goto fail;
+    }
+    if (fmt.fmt.pix.pixelformat != fourcc) {
+	printf("%s can't capture %.4s\n", device, (const char *)&fourcc);
+	goto fail;
+    }
+
+    if (ioctl(cap->fd, VIDIOC_REQBUFS, &req) < 0 || req.count < 2) {
+	printf("VIDIOC_REQBUFS failed: %s\n", strerror(errno));
+	goto fail;
+    }
+    cap->count = MIN2(req.count, CAPTURE_BUFFERS);
+
+    for (i = 0; i < cap->count; i++) {
+	struct v4l2_exportbuffer exp = {
+	    .type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+	    .index = i,
+	    .flags = O_RDONLY | O_CLOEXEC,
+	};
+	ESDmaBuf *buf = &cap->buffers[i].buf;
+
+	if (ioctl(cap->fd, VIDIOC_EXPBUF, &exp) < 0) {
+	    printf("VIDIOC_EXPBUF failed: %s\n", strerror(errno));
+	    goto fail;
+	}
+
+	buf->width = fmt.fmt.pix.width;
+	buf->height = fmt.fmt.pix.height;
+	buf->fourcc = fourcc;
+	buf->fd[0] = exp.fd;
+	buf->pitch[0] = fmt.fmt.pix.bytesperline;
+	buf->modifier = DRM_FORMAT_MOD_LINEAR;
+	buf->planes = 1;
+	if (fourcc == V4L2_PIX_FMT_NV12) {
+	    /* single-planar NV12: chroma follows luma in the same buffer */
+	    buf->planes = 2;
+	    buf->fd[1] = -1;
+	    buf->offset[1] = fmt.fmt.pix.bytesperline * fmt.fmt.pix.height;
+	    buf->pitch[1] = fmt.fmt.pix.bytesperline;
+	}
+
+	if (capture_queue(cap, i))
+	    goto fail;
+    }
+
+    if (ioctl(cap->fd, VIDIOC_STREAMON, &type) < 0) {
+	printf("VIDIOC_STREAMON failed: %s\n", strerror(errno));
+	goto fail;
+    }
+    if (!esRegisterFd(esContext, cap->fd, ES_FD_READ, capture_ready, cap))
+	goto fail;
+
+    printf("Capturing %dx%d %.4s from %s\n", fmt.fmt.pix.width,
+	   fmt.fmt.pix.height, (const char *)&fourcc, device);
+    return cap;
+
+fail:
+    esCloseCapture(cap);
+    return NULL;
+}
+
+///
+//  esCaptureFrame()
+//
+const ESDmaBuf *ESUTIL_API esCaptureFrame ( ESCapture *cap )
+{
+    if (cap->ready >= 0) {
+	if (cap->in_use >= 0) {
+	    /* the GPU may still be drawing with the old frame */
+	    struct capture_buffer *b = &cap->buffers[cap->in_use];
+
+	    b->state = CAPTURE_RELEASING;
+	    if (egl->eglCreateSyncKHR)
+		b->fence = egl->eglCreateSyncKHR(egl->display,
+						 EGL_SYNC_FENCE_KHR, NULL);
+	    glFlush();
+	}
+	cap->in_use = cap->ready;
+	cap->ready = -1;
+	cap->buffers[cap->in_use].state = CAPTURE_IN_USE;
+    }
+
+    capture_recycle(cap);
+
+    return cap->in_use >= 0 ? &cap->buffers[cap->in_use].buf : NULL;
+}
+
+///
+//  esCloseCapture()
+//
+void ESUTIL_API esCloseCapture ( ESCapture *cap )
+{
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    struct v4l2_requestbuffers req = {
+	.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+	.memory = V4L2_MEMORY_MMAP,
+    };
+    unsigned int i;
+
+    esUnregisterFd(cap->esContext, cap->fd);
+    ioctl(cap->fd, VIDIOC_STREAMOFF, &type);
+
+    for (i = 0; i < CAPTURE_BUFFERS; i++) {
+	struct capture_buffer *b = &cap->buffers[i];
+
+	if (b->fence)
+	    egl->eglDestroySyncKHR(egl->display, b->fence);
+	if (b->buf.fd[0] >= 0) {
+	    esReleaseDmaBuf(cap->esContext, b->buf.fd[0]);
+	    close(b->buf.fd[0]);
+	}
+    }
+
+    ioctl(cap->fd, VIDIOC_REQBUFS, &req);
+    close(cap->fd);
+    free(cap);
+}
+
+// input
+
+/*
+ * Keyboards, mice and touchscreens read straight from evdev, so input
+ * works without a terminal or a display server. Each device's fd sits
+ * in the main loop's epoll set; whatever has queued up is read in one
+ * go between frames. The kernel stamps events with CLOCK_MONOTONIC,
+ * the clock the frame times and page flip events use.
+ */
+#ifndef input_event_sec
+#define input_event_sec time.tv_sec
+#define input_event_usec time.tv_usec
+#endif
+
+#define INPUT_SLOTS 10
+#define LONG_BITS (8 * sizeof(long))
+#define NLONGS(n) (((n) + LONG_BITS - 1) / LONG_BITS)
+
+struct input_device {
+    int fd;
+    int keyboard;
+    int mt;			/* multitouch, with slots */
+    int touch;			/* single touch, ABS_X/Y and BTN_TOUCH */
+    int absolute;		/* a pointer with ABS_X/Y, like a tablet */
+    struct input_absinfo abs_x, abs_y;
+    int slot;
+    struct {
+	int active;
+	int pending;		/* ES_TOUCH_* to report, -1 if none */
+	int x, y;
+    } slots[INPUT_SLOTS];
+    int dropped;		/* lost events, skip to the next report */
+    struct input_device *next;
+};
+
+static struct {
+    struct input_device *devices;
+    ESPointerFunc pointerFunc;
+    ESTouchFunc touchFunc;
+    int width, height;		/* of the first output */
+    int x, y;
+    unsigned int buttons;
+    int moved;
+    int shift;
+    struct drm *drm;		/* of the first display, for its scaling */
+    double time;		/* of the event being handled */
+    double pending;		/* of the oldest event no update has seen yet */
+} input;
+
+/* US layout, by KEY_* code up to KEY_SPACE, unshifted and shifted */
+static const char input_keymap[2][KEY_SPACE + 1] = {
+    "\0\033" "1234567890-=" "\b\t" "qwertyuiop[]" "\r\0" "asdfghjkl;'`"
+    "\0\\" "zxcvbnm,./" "\0*\0 ",
+    "\0\033" "!@#$%^&*()_+" "\b\t" "QWERTYUIOP{}" "\r\0" "ASDFGHJKL:\"~"
+    "\0|" "ZXCVBNM<>?" "\0*\0 ",
+};
+
+static int test_bit(const unsigned long *bits, unsigned int bit)
+{
+    return (bits[bit / LONG_BITS] >> (bit % LONG_BITS)) & 1;
+}
+
+/* an absolute axis value in screen pixels */
+static int input_scale(const struct input_absinfo *abs, int value, int size)
+{
+    if (abs->maximum <= abs->minimum)
+	return value;
+    return (int)((int64_t)(value - abs->minimum) * (size - 1) /
+		 (abs->maximum - abs->minimum));
+}
+
+/* from a position on the screen to one on the scaled surface */
+static int input_unscale(int pos, int dst, int dst_size, int size)
+{
+    pos = (int)((int64_t)(pos - dst) * size / dst_size);
+    return MAX2(0, MIN2(pos, size - 1));
+}
+
+static void input_close(struct input_device *dev)
+{
+    struct input_device **dp;
+
+    for (dp = &input.devices; *dp; dp = &(*dp)->next) {
+	if (*dp == dev) {
+	    *dp = dev->next;
+	    break;
+	}
+    }
+    event_loop_remove(dev->fd);
+    close(dev->fd);
+    free(dev);
+}
+
+static void input_touch(struct input_device *dev, int slot, int state)
+{
+    if (slot < 0 || slot >= INPUT_SLOTS)
+	return;
+    if (state == ES_TOUCH_DOWN) {
+	dev->slots[slot].active = 1;
+	dev->slots[slot].pending = ES_TOUCH_DOWN;
+    } else if (state == ES_TOUCH_UP) {
+	if (dev->slots[slot].active)
+	    dev->slots[slot].pending = ES_TOUCH_UP;
+    } else if (dev->slots[slot].active && dev->slots[slot].pending < 0) {
+	dev->slots[slot].pending = ES_TOUCH_MOVE;
+    }
+}
+
+static void input_key(ESContext *esContext, struct input_device *dev,
+		      unsigned int code, int value)
+{
+    unsigned int button = code == BTN_LEFT ? ES_BUTTON_LEFT :
+	code == BTN_RIGHT ? ES_BUTTON_RIGHT :
+	code == BTN_MIDDLE ? ES_BUTTON_MIDDLE : 0;
+    char key = 0;
+
+    if (button) {
+	input.buttons = value ? input.buttons | button : input.buttons & ~button;
+	input.moved = 1;
+	return;
+    }
+    if (code == BTN_TOUCH && dev->touch) {
+	input_touch(dev, 0, value ? ES_TOUCH_DOWN : ES_TOUCH_UP);
+	return;
+    }
+    if (code == KEY_LEFTSHIFT || code == KEY_RIGHTSHIFT) {
+	input.shift = value != 0;
+	return;
+    }
+
+    /* presses and autorepeat, as a terminal would see them */
+    if (value == 0 || !esContext->keyFunc)
+	return;
+    if (code <= KEY_SPACE)
+	key = input_keymap[input.shift][code];
+    else if (code == KEY_KPENTER)
+	key = '\r';
+    if (key)
+	esContext->keyFunc(esContext, (unsigned char)key, input.x, input.y);
+}
+
+static void input_abs(struct input_device *dev, unsigned int code, int value)
+{
+    int *pos;
+
+    switch (code) {
+    case ABS_MT_SLOT:
+	dev->slot = value;
+	return;
+    case ABS_MT_TRACKING_ID:
+	input_touch(dev, dev->slot, value < 0 ? ES_TOUCH_UP : ES_TOUCH_DOWN);
+	return;
+    case ABS_MT_POSITION_X:
+    case ABS_MT_POSITION_Y:
+	if (!dev->mt || dev->slot < 0 || dev->slot >= INPUT_SLOTS)
+	    return;
+	pos = code == ABS_MT_POSITION_X ? &dev->slots[dev->slot].x :
+	    &dev->slots[dev->slot].y;
+	break;
+    case ABS_X:
+    case ABS_Y:
+	if (dev->touch)
+	    pos = code == ABS_X ? &dev->slots[0].x : &dev->slots[0].y;
+	else if (dev->absolute)
+	    pos = code == ABS_X ? &input.x : &input.y;
+	else
+	    return;
+	break;
+    default:
+	return;
+    }
+
+    /* touchscreens cover the whole screen, letterboxing included */
+    if (input.drm && input.drm->src_w && (dev->mt || dev->touch)) {
+	if (code == ABS_X || code == ABS_MT_POSITION_X)
+	    *pos = input_unscale(input_scale(&dev->abs_x, value,
+					     input.drm->mode->hdisplay),
+				 input.drm->dst_x, input.drm->dst_w, input.width);
+	else
+	    *pos = input_unscale(input_scale(&dev->abs_y, value,
+					     input.drm->mode->vdisplay),
+				 input.drm->dst_y, input.drm->dst_h, input.height);
+    } else if (code == ABS_X || code == ABS_MT_POSITION_X) {
+	*pos = input_scale(&dev->abs_x, value, input.width);
+    } else {
+	*pos = input_scale(&dev->abs_y, value, input.height);
+    }
+
+    if (pos == &input.x || pos == &input.y)
+	input.moved = 1;
+    else
+	input_touch(dev, dev->mt ? dev->slot : 0, ES_TOUCH_MOVE);
+}
+
+/* a complete report: pass on what it changed */
+static void input_report(ESContext *esContext, struct input_device *dev)
+{
+    int i;
+
+    if (input.moved && input.pointerFunc)
+	input.pointerFunc(esContext, input.x, input.y, input.buttons, input.time);
+    input.moved = 0;
+
+    for (i = 0; i < INPUT_SLOTS; i++) {
+	int state = dev->slots[i].pending;
+
+	if (state < 0)
+	    continue;
+	dev->slots[i].pending = -1;
+	if (state == ES_TOUCH_UP)
+	    dev->slots[i].active = 0;
+	if (input.touchFunc)
+	    input.touchFunc(esContext, i, state, dev->slots[i].x,
+			    dev->slots[i].y, input.time);
+    }
+}
+
+/*
+ * Catch up with the device's current state, when events were lost or
+ * when it is first opened: touches that went down or lifted meanwhile
+ * become pending, as if their events had arrived.
+ */
+static void input_sync(struct input_device *dev)
+{
+    unsigned long keys[NLONGS(KEY_CNT)] = { 0 };
+    struct {
+	__u32 code;
+	__s32 values[INPUT_SLOTS];
+    } ids, xs, ys;
+    struct input_absinfo abs;
+    int i;
+
+    if (ioctl(dev->fd, EVIOCGKEY(sizeof(keys)), keys) >= 0) {
+	unsigned int buttons = 0;
+
+	if (dev->keyboard)
+	    input.shift = test_bit(keys, KEY_LEFTSHIFT) ||
+		test_bit(keys, KEY_RIGHTSHIFT);
+	if (test_bit(keys, BTN_LEFT))
+	    buttons |= ES_BUTTON_LEFT;
+	if (test_bit(keys, BTN_RIGHT))
+	    buttons |= ES_BUTTON_RIGHT;
+	if (test_bit(keys, BTN_MIDDLE))
+	    buttons |= ES_BUTTON_MIDDLE;
+	if (!dev->keyboard && !dev->mt && !dev->touch &&
+	    buttons != input.buttons) {
+	    input.buttons = buttons;
+	    input.moved = 1;
+	}
+	if (dev->touch && test_bit(keys, BTN_TOUCH) != dev->slots[0].active)
+	    input_touch(dev, 0, test_bit(keys, BTN_TOUCH) ? ES_TOUCH_DOWN
+							   : ES_TOUCH_UP);
+    }
+
+    if (dev->touch || dev->absolute) {
+	if (ioctl(dev->fd, EVIOCGABS(ABS_X), &abs) == 0)
+	    input_abs(dev, ABS_X, abs.value);
+	if (ioctl(dev->fd, EVIOCGABS(ABS_Y), &abs) == 0)
+	    input_abs(dev, ABS_Y, abs.value);
+    }
+
+    if (!dev->mt)
+	return;
+
+    /* the kernel only fills in as many slots as the device has */
+    for (i = 0; i < INPUT_SLOTS; i++)
+	ids.values[i] = -1;
+    ids.code = ABS_MT_TRACKING_ID;
+    xs.code = ABS_MT_POSITION_X;
+    ys.code = ABS_MT_POSITION_Y;
+    if (ioctl(dev->fd, EVIOCGMTSLOTS(sizeof(ids)), &ids) < 0 ||
+	ioctl(dev->fd, EVIOCGMTSLOTS(sizeof(xs)), &xs) < 0 ||
+	ioctl(dev->fd, EVIOCGMTSLOTS(sizeof(ys)), &ys) < 0)
+	return;
+
+    for (i = 0; i < INPUT_SLOTS; i++) {
+	if (ids.values[i] < 0) {
+	    input_touch(dev, i, ES_TOUCH_UP);
+	    continue;
+	}
+	if (!dev->slots[i].active)
+	    input_touch(dev, i, ES_TOUCH_DOWN);
+	dev->slot = i;
+	input_abs(dev, ABS_MT_POSITION_X, xs.values[i]);
+	input_abs(dev, ABS_MT_POSITION_Y, ys.values[i]);
+    }
+
+    /* later events are relative to the slot the device is on now */
+    if (ioctl(dev->fd, EVIOCGABS(ABS_MT_SLOT), &abs) == 0)
+	dev->slot = abs.value;
+}
+
+static void input_event(ESContext *esContext, struct input_device *dev,
+			const struct input_event *ev)
+{
+    input.time = ev->input_event_sec + ev->input_event_usec * 1e-6;
+
+    /* Events up to the next report are incomplete; after it, the
+     * device is asked for the state they would have given us.
+     */
+    if (dev->dropped) {
+	if (ev->type == EV_SYN && ev->code == SYN_REPORT) {
+	    dev->dropped = 0;
+	    input_sync(dev);
+	    input_report(esContext, dev);
+	}
+	return;
+    }
+
+    if (ev->type != EV_SYN && !input.pending)
+	input.pending = input.time;
+
+    switch (ev->type) {
+    case EV_KEY:
+	input_key(esContext, dev, ev->code, ev->value);
+	break;
+    case EV_REL:
+	if (ev->code == REL_X)
+	    input.x = MAX2(0, MIN2(input.x + ev->value, input.width - 1));
+	else if (ev->code == REL_Y)
+	    input.y = MAX2(0, MIN2(input.y + ev->value, input.height - 1));
+	else
+	    break;
+	input.moved = 1;
+	break;
+    case EV_ABS:
+	input_abs(dev, ev->code, ev->value);
+	break;
+    case EV_SYN:
+	if (ev->code == SYN_DROPPED)
+	    dev->dropped = 1;
+	else if (ev->code == SYN_REPORT)
+	    input_report(esContext, dev);
+	break;
+    }
+}
+
+static void input_ready(ESContext *esContext, int fd, unsigned int events,
+			void *userData)
+{
+    struct input_device *dev = userData;
+    struct input_event ev[64];
+    ssize_t n;
+    size_t i;
+
+    (void)events;
+    for (;;) {
+	n = read(fd, ev, sizeof(ev));
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0) {
+	    /* ENODEV once the device is unplugged */
+	    if (n == 0 || errno != EAGAIN)
+		input_close(dev);
+	    return;
+	}
+	for (i = 0; i < n / sizeof(*ev); i++)
+	    input_event(esContext, dev, &ev[i]);
+	if ((size_t)n < sizeof(ev))
+	    return;
+    }
+}
+
+static int input_open(const char *path)
+{
+    unsigned long evbits[NLONGS(EV_CNT)] = { 0 };
+    unsigned long keybits[NLONGS(KEY_CNT)] = { 0 };
+    unsigned long relbits[NLONGS(REL_CNT)] = { 0 };
+    unsigned long absbits[NLONGS(ABS_CNT)] = { 0 };
+    unsigned long propbits[NLONGS(INPUT_PROP_CNT)] = { 0 };
+    struct input_device *dev;
+    int clock = CLOCK_MONOTONIC;
+    int fd, i;
+
+    fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+	return -1;
+    dev = calloc(1, sizeof(*dev));
+    if (!dev || ioctl(fd, EVIOCGBIT(0, sizeof(evbits)), evbits) < 0)
+	goto fail;
+    ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(keybits)), keybits);
+    ioctl(fd, EVIOCGBIT(EV_REL, sizeof(relbits)), relbits);
+    ioctl(fd, EVIOCGBIT(EV_ABS, sizeof(absbits)), absbits);
+    ioctl(fd, EVIOCGPROP(sizeof(propbits)), propbits);
+
+    /* Only a touchscreen maps touches to where they are on the screen.
+     * Touchpads, which the kernel doesn't mark as direct, would need
+     * pointer acceleration and gestures, so they are left out.
+     */
+    dev->fd = fd;
+    dev->keyboard = test_bit(keybits, KEY_A) && test_bit(keybits, KEY_SPACE);
+    dev->mt = test_bit(propbits, INPUT_PROP_DIRECT) &&
+	test_bit(absbits, ABS_MT_SLOT) &&
+	test_bit(absbits, ABS_MT_POSITION_X) && test_bit(absbits, ABS_MT_POSITION_Y);
+    dev->touch = !dev->mt && test_bit(propbits, INPUT_PROP_DIRECT) &&
+	test_bit(absbits, ABS_X) && test_bit(keybits, BTN_TOUCH);
+    dev->absolute = !dev->mt && !dev->touch && test_bit(absbits, ABS_X) &&
+	test_bit(keybits, BTN_LEFT) && !test_bit(keybits, BTN_TOOL_FINGER);
+    if (!dev->keyboard && !dev->mt && !dev->touch && !dev->absolute &&
+	!(test_bit(relbits, REL_X) && test_bit(relbits, REL_Y)))
+	goto fail;	/* power buttons, lid switches, ... */
+
+    ioctl(fd, EVIOCGABS(dev->mt ? ABS_MT_POSITION_X : ABS_X), &dev->abs_x);
+    ioctl(fd, EVIOCGABS(dev->mt ? ABS_MT_POSITION_Y : ABS_Y), &dev->abs_y);
+    for (i = 0; i < INPUT_SLOTS; i++)
+	dev->slots[i].pending = -1;
+    /* fingers already down when we start */
+    input_sync(dev);
+
+    /* timestamps on the clock everything else uses */
+    if (ioctl(fd, EVIOCSCLOCKID, &clock) < 0)
+	printf("%s: no monotonic timestamps\n", path);
+
+    if (!event_loop_add(fd, ES_FD_READ, input_ready, dev))
+	goto fail;
+    dev->next = input.devices;
+    input.devices = dev;
+    return 0;
+
+fail:
+    free(dev);
+    close(fd);
+    return -1;
+}
+
+/*
+ * Open the devices in ES_INPUT, a comma separated list, or else every
+ * /dev/input/event* we are allowed to read. ES_INPUT=0 opens none.
+ */
+static void input_init(ESContext *esContext)
+{
+    const char *env = getenv("ES_INPUT");
+    struct input_device *dev;
+    char path[300];
+
+    if (env && strcmp(env, "0") == 0)
+	return;
+
+    if (!outputs[0].drm.headless && outputs[0].drm.mode)
+	input.drm = &outputs[0].drm;
+    input.width = outputs[0].gbm.width ? outputs[0].gbm.width : esContext->width;
+    input.height = outputs[0].gbm.height ? outputs[0].gbm.height : esContext->height;
+    input.x = input.width / 2;
+    input.y = input.height / 2;
+
+    if (env && *env) {
+	char *list = strdup(env), *save = NULL, *name;
+
+	for (name = strtok_r(list, ",", &save); name;
+	     name = strtok_r(NULL, ",", &save)) {
+	    if (input_open(name))
+		printf("can't use input device %s\n", name);
+	}
+	free(list);
+    } else {
+	DIR *dir = opendir("/dev/input");
+	struct dirent *de;
+
+	while (dir && (de = readdir(dir))) {
+	    if (strncmp(de->d_name, "event", 5) != 0)
+		continue;
+	    snprintf(path, sizeof(path), "/dev/input/%s", de->d_name);
+	    input_open(path);
+	}
+	if (dir)
+	    closedir(dir);
+    }
+
+    /* typing goes to keyFunc now, not to the terminal */
+    for (dev = input.devices; dev; dev = dev->next) {
+	if (dev->keyboard && esContext->keyFunc)
+	    loop.stdin_drain = 1;
+    }
+}
+
+///
+//  esRegisterPointerFunc()
+//
+void ESUTIL_API esRegisterPointerFunc ( ESContext *esContext, ESPointerFunc pointerFunc )
+{
+    (void)esContext;
+    input.pointerFunc = pointerFunc;
+}
+
+///
+//  esRegisterTouchFunc()
+//
+void ESUTIL_API esRegisterTouchFunc ( ESContext *esContext, ESTouchFunc touchFunc )
+{
+    (void)esContext;
+    input.touchFunc = touchFunc;
+}
+
+///
+//  esGetInputTime()
+//
+double ESUTIL_API esGetInputTime ( ESContext *esContext )
+{
+    (void)esContext;
+    return input.time;
+}
+
+// input latency
+
+/*
+ * Each frame takes on the timestamp of the oldest input event that
+ * arrived before its update, and hands it to the page flip of the
+ * first output. When that flip completes, the time from the event to
+ * the frame reaching the screen goes into the "latency" histogram.
+ *
+ * ES_LATENCY_INJECT=hz makes the measurement self-contained: a uinput
+ * mouse is created, read like any other device, and nudged hz times a
+ * second. Together with --benchmark this gives input-to-photon
+ * latency as a repeatable number, without anyone touching anything.
+ */
+static struct {
+    int fd;			/* /dev/uinput */
+    int timer_fd;
+    int step;
+} inject = { .fd = -1, .timer_fd = -1, .step = 1 };
+
+/* the input time for the frame about to be updated */
+static double input_claim(void)
+{
+    double t = input.pending;
+
+    input.pending = 0;
+    return t;
+}
+
+static void inject_tick(ESContext *esContext, int fd, unsigned int events,
+			void *userData)
+{
+    struct input_event ev[2] = {
+	{ .type = EV_REL, .code = REL_X },
+	{ .type = EV_SYN, .code = SYN_REPORT },
+    };
+    uint64_t expirations;
+
+    (void)esContext, (void)events, (void)userData;
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+	return;
+
+    /* back and forth, so the pointer stays put */
+    inject.step = -inject.step;
+    ev[0].value = inject.step;
+    if (write(inject.fd, ev, sizeof(ev)) != sizeof(ev))
+	printf("uinput write failed: %s\n", strerror(errno));
+}
+
+/* the /dev/input/event* node of the uinput device, once it shows up */
+static int inject_node(char *path, size_t size)
+{
+    char sysname[64], dir_name[128];
+    int tries;
+
+    if (ioctl(inject.fd, UI_GET_SYSNAME(sizeof(sysname)), sysname) < 0)
+	return -1;
+    snprintf(dir_name, sizeof(dir_name), "/sys/devices/virtual/input/%s",
+	     sysname);
+
+    for (tries = 0; tries < 100; tries++) {
+	DIR *dir = opendir(dir_name);
+	struct dirent *de;
+
+	while (dir && (de = readdir(dir))) {
+	    if (strncmp(de->d_name, "event", 5) == 0) {
+		snprintf(path, size, "/dev/input/%s", de->d_name);
+		if (access(path, R_OK) == 0) {
+		    closedir(dir);
+		    return 0;
+		}
+	    }
+	}
+	if (dir)
+	    closedir(dir);
+	usleep(10000);
+    }
+    return -1;
+}
+
+/* stop the timer and take the uinput device away again */
+static void inject_fini(void)
+{
+    if (inject.timer_fd >= 0) {
+	event_loop_remove(inject.timer_fd);
+	close(inject.timer_fd);
+	inject.timer_fd = -1;
+    }
+    if (inject.fd >= 0) {
+	ioctl(inject.fd, UI_DEV_DESTROY);
+	close(inject.fd);
+	inject.fd = -1;
+    }
+}
+
+static void inject_init(void)
+{
+    const char *env = getenv("ES_LATENCY_INJECT");
+    struct uinput_setup setup = {
+	.id = { .bustype = BUS_VIRTUAL, .vendor = 0x1, .product = 0x1 },
+	.name = "esUtil latency probe",
+    };
+    double hz = env ? atof(env) : 0;
+    struct itimerspec its;
+    char path[300];
+
+    if (hz <= 0)
+	return;
+
+    its = (struct itimerspec) {
+	.it_interval = {
+	    .tv_sec = (time_t)(1.0 / hz),
+	    .tv_nsec = (long)((1.0 / hz - (time_t)(1.0 / hz)) * 1e9),
+	},
+    };
+    its.it_value = its.it_interval;
+    /* an all zero interval would disarm the timer instead */
+    if (!its.it_interval.tv_sec && !its.it_interval.tv_nsec) {
+	printf("ES_LATENCY_INJECT=%s is too fast\n", env);
+	return;
+    }
+
+    inject.fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if (inject.fd < 0 ||
+	ioctl(inject.fd, UI_SET_EVBIT, EV_KEY) < 0 ||
+	ioctl(inject.fd, UI_SET_KEYBIT, BTN_LEFT) < 0 ||
+	ioctl(inject.fd, UI_SET_EVBIT, EV_REL) < 0 ||
+	ioctl(inject.fd, UI_SET_RELBIT, REL_X) < 0 ||
+	ioctl(inject.fd, UI_SET_RELBIT, REL_Y) < 0 ||
+	ioctl(inject.fd, UI_DEV_SETUP, &setup) < 0 ||
+	ioctl(inject.fd, UI_DEV_CREATE) < 0) {
+	printf("can't create a uinput device: %s\n", strerror(errno));
+	goto fail;
+    }
+    if (inject_node(path, sizeof(path)) || input_open(path)) {
+	printf("can't read back the uinput device\n");
+	goto fail;
+    }
+
+    inject.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (inject.timer_fd < 0 ||
+	timerfd_settime(inject.timer_fd, 0, &its, NULL) < 0 ||
+	!event_loop_add(inject.timer_fd, ES_FD_READ, inject_tick, NULL))
+	goto fail;
+    printf("Injecting input at %.1f Hz through %s\n", hz, path);
+    return;
+
+fail:
+    inject_fini();
+}
+
+// async texture loading
+
+/*
+ * Loading a texture means disk reads, decoding and an upload, none of
+ * which should hold up a frame. Worker threads do all three, each with
+ * its own context sharing objects with the application's, and fence
+ * the upload; the main loop hands the texture over once the fence has
+ * signalled. Without EGL_KHR_surfaceless_context the workers can't
+ * make a context current, so they only decode and the main loop does
+ * the upload.
+ */
+#define LOADER_MAX_THREADS 4
+
+struct texture_job {
+    char *fileName;
+    ESTextureFunc func;
+    void *userData;
+
+    GLuint texture;
+    GLint width, height;
+    GLenum format;
+    unsigned char *pixels;	/* left for the main loop to upload */
+    EGLSyncKHR fence;
+    struct texture_job *next;
+};
+
+static struct {
+    pthread_t threads[LOADER_MAX_THREADS];
+    EGLContext contexts[LOADER_MAX_THREADS];
+    int count;
+    int shared;			/* workers upload through their own context */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct texture_job *queue, **queue_tail;
+    struct texture_job *done;	/* finished jobs, newest first */
+    int busy;			/* jobs not yet handed back */
+} loader = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static uint16_t le16(const unsigned char *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+/* an uncompressed TGA, as esLoadTGA() reads, but swapped to RGB(A) */
+static int loader_decode_tga(struct texture_job *job)
+{
+    unsigned char header[18];
+    FILE *f = fopen(job->fileName, "rb");
+    size_t size;
+    int bpp, i;
+
+    if (!f)
+	return -1;
+    if (fread(header, sizeof(header), 1, f) != 1 ||
+	(header[2] != 2 && header[2] != 3) ||
+	fseek(f, header[0], SEEK_CUR) != 0) {
+	fclose(f);
+	return -1;
+    }
+
+    job->width = le16(header + 12);
+    job->height = le16(header + 14);
+    bpp = header[16] / 8;
+    job->format = bpp == 4 ? GL_RGBA : bpp == 3 ? GL_RGB : GL_LUMINANCE;
+    if (bpp != 1 && bpp != 3 && bpp != 4) {
+	fclose(f);
+	return -1;
+    }
+
+    size = (size_t)job->width * job->height * bpp;
+    job->pixels = malloc(size);
+    if (!job->pixels || fread(job->pixels, size, 1, f) != 1) {
+	fclose(f);
+	return -1;
+    }
+    fclose(f);
+
+    for (i = 0; bpp >= 3 && i < job->width * job->height; i++) {
+	unsigned char *px = job->pixels + i * bpp;
+	unsigned char b = px[0];
+
+	px[0] = px[2];
+	px[2] = b;
+    }
+    return 0;
+}
+
+static void loader_upload(struct texture_job *job)
+{
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glGenTextures(1, &job->texture);
+    glBindTexture(GL_TEXTURE_2D, job->texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, job->format, job->width, job->height, 0,
+		 job->format, GL_UNSIGNED_BYTE, job->pixels);
+    glGenerateMipmap(GL_TEXTURE_2D);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    free(job->pixels);
+    job->pixels = NULL;
+}
+
+static void *loader_thread(void *arg)
+{
+    EGLContext context = arg;
+    struct texture_job *job;
+
+    if (context != EGL_NO_CONTEXT)
+	eglMakeCurrent(egl->display, EGL_NO_SURFACE, EGL_NO_SURFACE, context);
+
+    pthread_mutex_lock(&loader.lock);
+    while (1) {
+	while (!loader.queue)
+	    pthread_cond_wait(&loader.cond, &loader.lock);
+	job = loader.queue;
+	loader.queue = job->next;
+	if (!loader.queue)
+	    loader.queue_tail = &loader.queue;
+	pthread_mutex_unlock(&loader.lock);
+
+	if (loader_decode_tga(job)) {
+	    printf("esLoadTextureAsync: can't load %s\n", job->fileName);
+	    free(job->pixels);
+	    job->pixels = NULL;
+	} else if (context != EGL_NO_CONTEXT) {
+	    loader_upload(job);
+	    job->fence = egl->eglCreateSyncKHR(egl->display,
+					       EGL_SYNC_FENCE_KHR, NULL);
+	    glFlush();
+	}
+
+	pthread_mutex_lock(&loader.lock);
+	job->next = loader.done;
+	loader.done = job;
+    }
+    return NULL;
+}
+
+static int loader_init(void)
+{
+    static const EGLint context_attribs[] = {
+	EGL_CONTEXT_CLIENT_VERSION, 3,
+	EGL_NONE
+    };
+    const char *env_threads = getenv("ES_LOADER_THREADS");
+    sigset_t all, old;
+    int i, n;
+
+    if (loader.count)
+	return 0;
+
+    n = env_threads ? atoi(env_threads) : 2;
+    n = MAX2(1, MIN2(n, LOADER_MAX_THREADS));
+    loader.queue_tail = &loader.queue;
+    loader.shared = egl->eglCreateSyncKHR && egl->eglClientWaitSyncKHR &&
+	has_ext(eglQueryString(egl->display, EGL_EXTENSIONS),
+		"EGL_KHR_surfaceless_context");
+
+    /* signals are for the main loop's signalfd, never the workers */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for (i = 0; i < n; i++) {
+	loader.contexts[i] = loader.shared ?
+	    eglCreateContext(egl->display, egl->config, egl->context,
+			     context_attribs) : EGL_NO_CONTEXT;
+	if (pthread_create(&loader.threads[i], NULL, loader_thread,
+			   loader.contexts[i])) {
+	    if (loader.contexts[i] != EGL_NO_CONTEXT)
+		eglDestroyContext(egl->display, loader.contexts[i]);
+	    loader.contexts[i] = EGL_NO_CONTEXT;
+	    break;
+	}
+	pthread_detach(loader.threads[i]);
+	loader.count++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    return loader.count ? 0 : -1;
+}
+
+/*
+ * Called each frame: hand back the textures that are ready to use,
+ * uploading any the workers could not.
+ */
+static void textures_poll(ESContext *esContext)
+{
+    struct texture_job *job, *pending = NULL, *done;
+
+    if (!__atomic_load_n(&loader.busy, __ATOMIC_RELAXED))
+	return;
+
+    pthread_mutex_lock(&loader.lock);
+    done = loader.done;
+    loader.done = NULL;
+    pthread_mutex_unlock(&loader.lock);
+
+    while (done) {
+	job = done;
+	done = job->next;
+
+	if (job->fence) {
+	    if (egl->eglClientWaitSyncKHR(egl->display, job->fence, 0, 0) ==
+		EGL_TIMEOUT_EXPIRED_KHR) {
+		job->next = pending;
+		pending = job;
+		continue;
+	    }
+	    egl->eglDestroySyncKHR(egl->display, job->fence);
+	}
+	if (job->pixels)
+	    loader_upload(job);
+
+	job->func(esContext, job->texture, job->width, job->height, job->userData);
+	__atomic_sub_fetch(&loader.busy, 1, __ATOMIC_RELAXED);
+	free(job->fileName);
+	free(job);
+    }
+
+    if (pending) {
+	/* try again next frame */
+	pthread_mutex_lock(&loader.lock);
+	for (job = pending; job->next; job = job->next)
+	    ;
+	job->next = loader.done;
+	loader.done = pending;
+	pthread_mutex_unlock(&loader.lock);
+    }
+}
+
+///
+//  esLoadTextureAsync()
+//
+GLboolean ESUTIL_API esLoadTextureAsync ( ESContext *esContext, const char *fileName,
+					  ESTextureFunc doneFunc, void *userData )
+{
+    struct texture_job *job;
+
+    (void)esContext;
+    if (!egl || doneFunc == NULL || loader_init())
+	return GL_FALSE;
+
+    job = calloc(1, sizeof(*job));
+    if (!job || !(job->fileName = strdup(fileName))) {
+	free(job);
+	return GL_FALSE;
+    }
+    job->func = doneFunc;
+    job->userData = userData;
+
+    __atomic_add_fetch(&loader.busy, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&loader.lock);
+    *loader.queue_tail = job;
+    loader.queue_tail = &job->next;
+    pthread_cond_signal(&loader.cond);
+    pthread_mutex_unlock(&loader.lock);
+
+    return GL_TRUE;
+}
+
+// update thread
+
+/*
+ * With esRegisterUpdateState() the update function runs on a thread of
+ * its own, working out frame N+1 while the main thread draws frame N.
+ * The state it passes to the draw function is double buffered: the
+ * update thread writes one copy while the draw function reads the
+ * other, and the two swap roles once a frame. Only the main thread
+ * swaps them, and only while the update thread is waiting to be told
+ * to go, so the buffers need no lock. The go/done handshake is a pair
+ * of semaphores.
+ */
+static struct {
+    void *state[2];
+    size_t size;
+    int write;			/* state[write] belongs to the update thread */
+    int threaded;
+    int started;
+    volatile int quit;
+    float dt;
+    double input_time;		/* of the input the running update answers */
+    pthread_t thread;
+    sem_t go, done;
+} update;
+
+static void *update_thread(void *arg)
+{
+    ESContext *esContext = arg;
+
+    for (;;) {
+	sem_wait(&update.go);
+	if (update.quit)
+	    break;
+
+	/* carry on from the state being drawn */
+	memcpy(update.state[update.write], update.state[!update.write],
+	       update.size);
+	esContext->updateFunc(esContext, update.dt);
+	sem_post(&update.done);
+    }
+    return NULL;
+}
+
+static int update_start(ESContext *esContext)
+{
+    sigset_t all, old;
+    int ret;
+
+    if (sem_init(&update.go, 0, 0) || sem_init(&update.done, 0, 0))
+	return -1;
+
+    /* signals are for the main loop's signalfd */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    ret = pthread_create(&update.thread, NULL, update_thread, esContext);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return ret ? -1 : 0;
+}
+
+/*
+ * Run the update for the next frame. Threaded, this collects the state
+ * the update thread finished during the last frame for drawing, and
+ * sets it going on the frame after. input_time is swapped for that of
+ * the state now being drawn.
+ */
+static void update_run(ESContext *esContext, float dt, double *input_time)
+{
+    double t;
+
+    if (!esContext->updateFunc)
+	return;
+    if (!update.threaded) {
+	esContext->updateFunc(esContext, dt);
+	return;
+    }
+
+    if (update.started) {
+	sem_wait(&update.done);
+    } else if (update_start(esContext) == 0) {
+	update.started = 1;
+    } else {
+	printf("no update thread, updating inline\n");
+	update.threaded = 0;
+	esContext->updateFunc(esContext, dt);
+	return;
+    }
+
+    update.write = !update.write;
+    update.dt = dt;
+
+    /* the input goes with the update, and is drawn a frame later */
+    t = update.input_time;
+    update.input_time = *input_time;
+    *input_time = t;
+    sem_post(&update.go);
+}
+
+/* let the update thread finish what it is doing, and stop it */
+static void update_stop(void)
+{
+    if (!update.started)
+	return;
+    update.quit = 1;
+    sem_post(&update.go);
+    pthread_join(update.thread, NULL);
+    update.started = 0;
+}
+
+///
+//  esRegisterUpdateState()
+//
+GLboolean ESUTIL_API esRegisterUpdateState ( ESContext *esContext, size_t size )
+{
+    const char *env = getenv("ES_UPDATE_THREAD");
+
+    (void)esContext;
+    if (update.size || size == 0)
+	return GL_FALSE;
+
+    update.state[0] = calloc(1, size);
+    update.state[1] = calloc(1, size);
+    if (!update.state[0] || !update.state[1]) {
+	free(update.state[0]);
+	free(update.state[1]);
+	update.state[0] = update.state[1] = NULL;
+	return GL_FALSE;
+    }
+    update.size = size;
+    update.threaded = !(env && strcmp(env, "0") == 0);
+    return GL_TRUE;
+}
+
+///
+//  esGetUpdateState()
+//
+void *ESUTIL_API esGetUpdateState ( ESContext *esContext )
+{
+    (void)esContext;
+    return update.state[update.write];
+}
+
+///
+//  esGetDrawState()
+//
+const void *ESUTIL_API esGetDrawState ( ESContext *esContext )
+{
+    (void)esContext;
+    /* inline, the update has finished by the time anything is drawn */
+    return update.state[update.threaded ? !update.write : update.write];
+}
+
+// frame statistics
+
+/*
+ * Each phase gets a log-linear histogram of microseconds: 8 buckets
+ * per power of two, so any value is within 12.5% of its bucket. Only
+ * the render loop writes to it; relaxed atomics let esGetFrameStats()
+ * read it from any thread without a lock.
+ */
+#define STATS_SUB_BUCKETS 8
+#define STATS_BUCKETS (30 * STATS_SUB_BUCKETS)
+
+struct histogram {
+    uint32_t count[STATS_BUCKETS];
+    uint32_t n;
+    uint32_t max_us;
+    uint64_t total_us;
+};
+
+static struct histogram stats[ES_PHASE_COUNT];
+static uint32_t stats_frames;
+static uint64_t stats_modifier = DRM_FORMAT_MOD_INVALID;	/* of the scanout buffers */
+
+static FILE *stats_file;
+static double stats_period, stats_next_dump;
+
+static const char *phase_names[ES_PHASE_COUNT] = {
+    [ES_PHASE_UPDATE] = "update",
+    [ES_PHASE_DRAW] = "draw",
+    [ES_PHASE_SWAP] = "swap",
+    [ES_PHASE_LOCK] = "lock",
+    [ES_PHASE_FB] = "fb",
+    [ES_PHASE_FLIP] = "flip",
+    [ES_PHASE_WAIT] = "wait",
+    [ES_PHASE_FRAME] = "frame",
+    [ES_PHASE_PRESENT] = "present",
+    [ES_PHASE_LATENCY] = "latency",
+};
+
+static unsigned int stats_bucket(uint32_t us)
+{
+    int shift;
+
+    if (us < STATS_SUB_BUCKETS)
+	return us;
+
+    /* position of the top bit, less the 3 bits that pick the sub-bucket */
+    shift = 31 - __builtin_clz(us) - 3;
+    return MIN2((shift + 1) * STATS_SUB_BUCKETS +
+		((us >> shift) & (STATS_SUB_BUCKETS - 1)), STATS_BUCKETS - 1);
+}
+
+/* middle of the range of values that land in bucket b */
+static double stats_bucket_value(unsigned int b)
+{
+    unsigned int shift;
+
+    if (b < STATS_SUB_BUCKETS)
+	return b;
+
+    shift = b / STATS_SUB_BUCKETS - 1;
+    return (double)((STATS_SUB_BUCKETS + b % STATS_SUB_BUCKETS) << shift) +
+	((1u << shift) - 1) / 2.0;
+}
+
+static void stats_record(ESFramePhase phase, double seconds)
+{
+    struct histogram *h = &stats[phase];
+    uint32_t us = seconds <= 0 ? 0 :
+	seconds >= 4000.0 ? UINT32_MAX : (uint32_t)(seconds * 1e6);
+
+    __atomic_fetch_add(&h->count[stats_bucket(us)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->total_us, us, __ATOMIC_RELAXED);
+    if (us > __atomic_load_n(&h->max_us, __ATOMIC_RELAXED))
+	__atomic_store_n(&h->max_us, us, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->n, 1, __ATOMIC_RELAXED);
+}
+
+/* record the phase that started at start, and return the time now */
+static double phase_end(ESFramePhase phase, double start)
+{
+    double now = get_time();
+
+    stats_record(phase, now - start);
+    return now;
+}
+
+/* like phase_end(), but adds to this frame's total for the phase */
+static double phase_add(double *frame, ESFramePhase phase, double start)
+{
+    double now = get_time();
+
+    frame[phase] += now - start;
+    return now;
+}
+
+static void stats_summarise(const struct histogram *h, ESPhaseStats *ps)
+{
+    uint32_t count[STATS_BUCKETS];
+    uint32_t n = 0, seen = 0;
+    const double pct[3] = { 0.50, 0.95, 0.99 };
+    float *out[3] = { &ps->p50, &ps->p95, &ps->p99 };
+    unsigned int b, p = 0;
+
+    memset(ps, 0, sizeof(*ps));
+
+    /* the histogram may be moving under us, so work on a copy */
+    for (b = 0; b < STATS_BUCKETS; b++) {
+	count[b] = __atomic_load_n(&h->count[b], __ATOMIC_RELAXED);
+	n += count[b];
     }
+    if (n == 0)
+	return;
 
-    gbm_bo_set_user_data(bo, fb, drm_fb_destroy_callback);
+    ps->count = n;
+    ps->mean = __atomic_load_n(&h->total_us, __ATOMIC_RELAXED) / 1000.0 / n;
+    ps->max = __atomic_load_n(&h->max_us, __ATOMIC_RELAXED) / 1000.0;
 
-    return fb;
+    for (b = 0; b < STATS_BUCKETS && p < 3; b++) {
+	seen += count[b];
+	while (p < 3 && seen >= pct[p] * n)
+	    *out[p++] = MIN2(stats_bucket_value(b) / 1000.0, ps->max);
+    }
 }
 
-// from drm-legacy.c
+static void stats_dump(FILE *f)
+{
+    ESPhaseStats ps;
+    int i;
 
-static void page_flip_handler(int fd, unsigned int frame,
-			      unsigned int sec, unsigned int usec, void *data)
+    stats_summarise(&stats[ES_PHASE_PRESENT], &ps);
+    fprintf(f, "frames %u modifier 0x%016" PRIx64 " vrr %s refresh %.1f Hz\n",
+	    __atomic_load_n(&stats_frames, __ATOMIC_RELAXED), stats_modifier,
+	    outputs[0].drm.vrr ? "on" : "off",
+	    ps.mean > 0 ? 1000.0 / ps.mean : 0.0);
+    for (i = 0; i < ES_PHASE_COUNT; i++) {
+	stats_summarise(&stats[i], &ps);
+	fprintf(f, "  %-8s n %-8u mean %8.3f p50 %8.3f p95 %8.3f p99 %8.3f max %8.3f ms\n",
+		phase_names[i], ps.count, ps.mean, ps.p50, ps.p95, ps.p99, ps.max);
+    }
+    fflush(f);
+}
+
+/*
+ * ES_FRAME_STATS=stderr or a file name turns on a periodic dump,
+ * every ES_FRAME_STATS_PERIOD seconds (default 5).
+ */
+static void stats_init(void)
 {
-    /* suppress 'unused parameter' warnings */
-    (void)fd, (void)frame, (void)sec, (void)usec;
+    const char *name = getenv("ES_FRAME_STATS");
+    const char *period = getenv("ES_FRAME_STATS_PERIOD");
+
+    if (!name || !*name)
+	return;
+
+    stats_file = strcmp(name, "stderr") == 0 ? stderr : fopen(name, "w");
+    if (!stats_file) {
+	printf("can't open %s: %s\n", name, strerror(errno));
+	return;
+    }
+    stats_period = period ? atof(period) : 5.0;
+    if (stats_period <= 0)
+	stats_period = 5.0;
+    stats_next_dump = get_time() + stats_period;
+}
+
+static void stats_frame_done(double now)
+{
+    __atomic_fetch_add(&stats_frames, 1, __ATOMIC_RELAXED);
+
+    if (stats_file && now >= stats_next_dump) {
+	stats_dump(stats_file);
+	stats_next_dump = now + stats_period;
+    }
+}
+
+///
+//  esGetFrameStats()
+//
+GLboolean ESUTIL_API esGetFrameStats ( ESContext *esContext, ESFrameStats *stats_out )
+{
+    int i;
+
+    (void)esContext;
+    if (stats_out == NULL)
+	return GL_FALSE;
+
+    stats_out->frames = __atomic_load_n(&stats_frames, __ATOMIC_RELAXED);
+    stats_out->modifier = stats_modifier;
+    for (i = 0; i < ES_PHASE_COUNT; i++)
+	stats_summarise(&stats[i], &stats_out->phase[i]);
+    stats_out->vrr = outputs[0].drm.vrr ? GL_TRUE : GL_FALSE;
+    stats_out->refresh = stats_out->phase[ES_PHASE_PRESENT].mean > 0 ?
+	1000.0f / stats_out->phase[ES_PHASE_PRESENT].mean : 0.0f;
+
+    return stats_out->frames ? GL_TRUE : GL_FALSE;
+}
+
+///
+//  esFramePhaseName()
+//
+const char *ESUTIL_API esFramePhaseName ( ESFramePhase phase )
+{
+    if (phase < 0 || phase >= ES_PHASE_COUNT)
+	return "unknown";
+    return phase_names[phase];
+}
+
+// benchmark mode
+
+/*
+ * --benchmark=W,N on the command line (or ES_BENCHMARK=W,N) runs W
+ * warm-up frames then N measured frames, passing updateFunc a fixed
+ * timestep (ES_BENCHMARK_STEP, default 1/60 s) so every run does the
+ * same work, and then writes a JSON report to stdout or to
+ * --benchmark-output=FILE (ES_BENCHMARK_OUTPUT).
+ */
+#define BENCH_QUERIES 4
+
+static struct {
+    int warmup, frames;		/* frames == 0: not benchmarking */
+    float step;
+    const char *output;
+    double start_time, start_cpu;
+
+    /* GPU time of drawFunc, from GL_EXT_disjoint_timer_query */
+    PFNGLGENQUERIESEXTPROC glGenQueriesEXT;
+    PFNGLBEGINQUERYEXTPROC glBeginQueryEXT;
+    PFNGLENDQUERYEXTPROC glEndQueryEXT;
+    PFNGLGETQUERYOBJECTUI64VEXTPROC glGetQueryObjectui64vEXT;
+    GLuint queries[BENCH_QUERIES];
+    int pending[BENCH_QUERIES];	/* 0 idle, 1 warm-up, 2 measured */
+    unsigned int next_query;
+    uint64_t gpu_ns;
+} bench;
+
+static void bench_parse(const char *arg)
+{
+    int warmup, frames;
+
+    switch (sscanf(arg, "%d,%d", &warmup, &frames)) {
+    case 1:
+	frames = warmup;
+	/* fall through */
+    case 2:
+	bench.warmup = MAX2(warmup, 0);
+	bench.frames = MAX2(frames, 0);
+	break;
+    default:
+	printf("bad benchmark setting \"%s\", want warmup,frames\n", arg);
+    }
+}
+
+static double get_cpu_time(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void bench_init(void)
+{
+    const char *step = getenv("ES_BENCHMARK_STEP");
+    const char *gl_exts = (const char *) glGetString(GL_EXTENSIONS);
+
+    bench.step = step && atof(step) > 0 ? atof(step) : 1.0f / 60.0f;
+    if (!bench.output)
+	bench.output = getenv("ES_BENCHMARK_OUTPUT");
+
+    if (has_ext(gl_exts, "GL_EXT_disjoint_timer_query")) {
+	bench.glGenQueriesEXT = (void *) eglGetProcAddress("glGenQueriesEXT");
+	bench.glBeginQueryEXT = (void *) eglGetProcAddress("glBeginQueryEXT");
+	bench.glEndQueryEXT = (void *) eglGetProcAddress("glEndQueryEXT");
+	bench.glGetQueryObjectui64vEXT =
+	    (void *) eglGetProcAddress("glGetQueryObjectui64vEXT");
+    }
+    if (bench.glGenQueriesEXT && bench.glBeginQueryEXT &&
+	bench.glEndQueryEXT && bench.glGetQueryObjectui64vEXT)
+	bench.glGenQueriesEXT(BENCH_QUERIES, bench.queries);
+    else
+	bench.glBeginQueryEXT = NULL;
+}
+
+static void bench_collect(unsigned int i)
+{
+    GLuint64 ns = 0;
+
+    if (!bench.pending[i])
+	return;
+    bench.glGetQueryObjectui64vEXT(bench.queries[i], GL_QUERY_RESULT_EXT, &ns);
+    if (bench.pending[i] == 2)
+	bench.gpu_ns += ns;
+    bench.pending[i] = 0;
+}
+
+/* the queries are used round robin, so results are read back late */
+static void bench_gpu_begin(void)
+{
+    if (!bench.glBeginQueryEXT)
+	return;
+    bench_collect(bench.next_query);
+    bench.glBeginQueryEXT(GL_TIME_ELAPSED_EXT, bench.queries[bench.next_query]);
+}
+
+static void bench_gpu_end(int drawn)
+{
+    if (!bench.glBeginQueryEXT)
+	return;
+    bench.glEndQueryEXT(GL_TIME_ELAPSED_EXT);
+    bench.pending[bench.next_query] = drawn > bench.warmup ? 2 : 1;
+    bench.next_query = (bench.next_query + 1) % BENCH_QUERIES;
+}
+
+static void stats_reset(void)
+{
+    int i, b;
+
+    for (i = 0; i < ES_PHASE_COUNT; i++) {
+	for (b = 0; b < STATS_BUCKETS; b++)
+	    __atomic_store_n(&stats[i].count[b], 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&stats[i].n, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&stats[i].max_us, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&stats[i].total_us, 0, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&stats_frames, 0, __ATOMIC_RELAXED);
+}
+
+static void bench_report(double now)
+{
+    double seconds = now - bench.start_time;
+    double cpu = get_cpu_time() - bench.start_cpu;
+    GLint disjoint = 0;
+    ESPhaseStats ps;
+    /* stdout belongs to the application, so keep the report apart */
+    FILE *f = stderr;
+    int i;
+
+    if (bench.glBeginQueryEXT) {
+	for (i = 0; i < BENCH_QUERIES; i++)
+	    bench_collect(i);
+	/* GPU timings are meaningless if the clock changed under us */
+	glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+    }
+
+    if (bench.output && !(f = fopen(bench.output, "w"))) {
+	printf("can't open %s: %s\n", bench.output, strerror(errno));
+	f = stderr;
+    }
+
+    fprintf(f, "{\n");
+    fprintf(f, "  \"warmup\": %d,\n", bench.warmup);
+    fprintf(f, "  \"frames\": %d,\n", bench.frames);
+    fprintf(f, "  \"timestep\": %.6f,\n", bench.step);
+    fprintf(f, "  \"seconds\": %.6f,\n", seconds);
+    fprintf(f, "  \"fps\": %.3f,\n", seconds > 0 ? bench.frames / seconds : 0.0);
+    fprintf(f, "  \"cpu_seconds\": %.6f,\n", cpu);
+    if (bench.glBeginQueryEXT && !disjoint)
+	fprintf(f, "  \"gpu_seconds\": %.6f,\n", bench.gpu_ns * 1e-9);
+    else
+	fprintf(f, "  \"gpu_seconds\": null,\n");
+    fprintf(f, "  \"phases\": {\n");
+    for (i = 0; i < ES_PHASE_COUNT; i++) {
+	stats_summarise(&stats[i], &ps);
+	fprintf(f, "    \"%s\": { \"count\": %u, \"mean_ms\": %.4f, "
+		"\"p50_ms\": %.4f, \"p95_ms\": %.4f, \"p99_ms\": %.4f, "
+		"\"max_ms\": %.4f }%s\n",
+		phase_names[i], ps.count, ps.mean, ps.p50, ps.p95, ps.p99,
+		ps.max, i + 1 < ES_PHASE_COUNT ? "," : "");
+    }
+    fprintf(f, "  }\n}\n");
 
-    int *waiting_for_flip = data;
-    *waiting_for_flip = 0;
+    if (f != stderr)
+	fclose(f);
+    else
+	fflush(f);
+}
+
+/*
+ * Called at the start of each frame with the number of frames drawn
+ * so far; returns 1 once the run is over.
+ */
+static int bench_frame_done(int drawn, double now)
+{
+    if (drawn == bench.warmup) {
+	stats_reset();
+	bench.start_time = now;
+	bench.start_cpu = get_cpu_time();
+    }
+    if (drawn < bench.warmup + bench.frames)
+	return 0;
+
+    bench_report(now);
+    return 1;
+}
+
+// swapchain
+
+/*
+ * The scanout buffers, allocated and registered as framebuffers
+ * before the first frame, so that no frame pays for a GBM allocation
+ * or drmModeAddFB2(). GBM hands back the least recently used free
+ * buffer, so once these exist the loop keeps cycling through them.
+ */
+static struct {
+    struct gbm_bo *bo[3];
+    int depth;
+} swapchain;
+
+/* With atomic modesetting and native fences the GPU and KMS
+ * synchronise with each other, so the CPU only ever waits for
+ * the previous flip before queueing the next one.
+ */
+static int swapchain_fenced(void)
+{
+    return drm->page_flip == atomic_page_flip &&
+	egl->eglDupNativeFenceFDANDROID && egl->eglCreateSyncKHR &&
+	egl->eglDestroySyncKHR && egl->eglWaitSyncKHR;
+}
+
+/* Buffers in the swap queue: 2 waits for each flip before
+ * starting the next frame, 3 keeps a flip in flight while the
+ * next frame is drawn into a third buffer.
+ */
+static int swapchain_depth(void)
+{
+    const char *env_depth = getenv("ES_DRM_QUEUE_DEPTH");
+    int depth;
+
+    if (swapchain.depth)
+	return swapchain.depth;
+
+    depth = env_depth ? atoi(env_depth) : (swapchain_fenced() ? 3 : 2);
+    swapchain.depth = MAX2(2, MIN2(depth, (int)ARRAY_SIZE(swapchain.bo)));
+    return swapchain.depth;
+}
+
+/*
+ * Cycle the surface through all its buffers, cleared to black, and
+ * return the last one, still locked, to be shown by the modeset.
+ */
+static struct gbm_bo *swapchain_init(ESContext *esContext, struct gbm *gbm,
+				     int scanout)
+{
+    GLfloat clear[4];
+    int depth = swapchain_depth();
+    int i;
+
+    glGetFloatv(GL_COLOR_CLEAR_VALUE, clear);
+    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+
+    for (i = 0; i < depth; i++) {
+	glClear(GL_COLOR_BUFFER_BIT);
+	eglSwapBuffers(esContext->eglDisplay, esContext->eglSurface);
+	swapchain.bo[i] = gbm->surface ?
+	    gbm_surface_lock_front_buffer(gbm->surface) : NULL;
+	if (scanout && (!swapchain.bo[i] || !drm_fb_get_from_bo(swapchain.bo[i]))) {
+	    fprintf(stderr, "Failed to get a new framebuffer BO\n");
+	    return NULL;
+	}
+    }
+
+    glClearColor(clear[0], clear[1], clear[2], clear[3]);
+
+    for (i = 0; gbm->surface && i < depth - 1; i++)
+	gbm_surface_release_buffer(gbm->surface, swapchain.bo[i]);
+
+    return swapchain.bo[depth - 1];
+}
+
+///
+//  esGetSwapchainDepth()
+//
+GLint ESUTIL_API esGetSwapchainDepth ( ESContext *esContext )
+{
+    (void)esContext;
+    return egl ? swapchain_depth() : 0;
+}
+
+static float frame_interval;
+
+///
+//  esGetFrameInterval()
+//
+float ESUTIL_API esGetFrameInterval ( ESContext *esContext )
+{
+    (void)esContext;
+    return frame_interval;
+}
+
+/* Draw to output i from now on */
+static void output_make_current(ESContext *esContext, int i)
+{
+    output_current = i;
+    if (esContext->eglSurface == outputs[i].surface)
+	return;
+    esContext->eglSurface = outputs[i].surface;
+    eglMakeCurrent(egl->display, outputs[i].surface, outputs[i].surface,
+		   egl->context);
+}
+
+/*
+ * setup_scaling() tried a linear buffer, but GBM may since have picked a
+ * tiled or compressed layout that the plane won't scale. Test the
+ * first real framebuffer before the modeset, and if it is refused,
+ * start output i over with linear buffers of the same size, so the
+ * application's idea of the window doesn't change.
+ */
+static int output_check_scaling(ESContext *esContext, int i)
+{
+    struct output *o = &outputs[i];
+    uint64_t linear = DRM_FORMAT_MOD_LINEAR;
+    uint32_t flags = DRM_MODE_ATOMIC_TEST_ONLY | DRM_MODE_ATOMIC_ALLOW_MODESET;
+    struct drm_fb *fb = drm_fb_get_from_bo(o->bo);
+
+    if (!o->drm.src_w || !o->drm.plane || !fb ||
+	drm_atomic_commit(&o->drm, fb->fb_id, flags, NULL) == 0)
+	return 0;
+    if (!gbm_bo_get_modifier || gbm_bo_get_modifier(o->bo) == linear)
+	return -1;
+
+    printf("output %d can't scale modifier 0x%016" PRIx64
+	   ", using linear buffers\n", i, gbm_bo_get_modifier(o->bo));
+    gbm_surface_release_buffer(o->gbm.surface, o->bo);
+    eglMakeCurrent(egl->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroySurface(egl->display, o->surface);
+    gbm_surface_destroy(o->gbm.surface);
+    o->surface = EGL_NO_SURFACE;
+    esContext->eglSurface = EGL_NO_SURFACE;
+
+    if (init_gbm(&o->gbm, o->gbm.dev, o->gbm.width, o->gbm.height,
+		 o->gbm.format, &linear, 1))
+	return -1;
+    o->surface = eglCreateWindowSurface(egl->display, egl->config,
+					(EGLNativeWindowType)o->gbm.surface, NULL);
+    if (o->surface == EGL_NO_SURFACE)
+	return -1;
+    o->flip.surface = o->gbm.surface;
+    output_make_current(esContext, i);
+    o->bo = swapchain_init(esContext, &o->gbm, 1);
+    fb = o->bo ? drm_fb_get_from_bo(o->bo) : NULL;
+
+    return fb && drm_atomic_commit(&o->drm, fb->fb_id, flags, NULL) == 0 ? 0 : -1;
+}
+
+///
+//  esGetOutputCount()
+//
+GLint ESUTIL_API esGetOutputCount ( ESContext *esContext )
+{
+    (void)esContext;
+    return output_count;
+}
+
+///
+//  esGetCurrentOutput()
+//
+GLint ESUTIL_API esGetCurrentOutput ( ESContext *esContext )
+{
+    (void)esContext;
+    return output_current;
+}
+
+///
+//  esGetOutputRect()
+//
+GLboolean ESUTIL_API esGetOutputRect ( ESContext *esContext, GLint index,
+				       GLint *x, GLint *y,
+				       GLint *width, GLint *height )
+{
+    (void)esContext;
+    if (index < 0 || index >= output_count)
+	return GL_FALSE;
+
+    /* side by side, left to right in connector order */
+    if (x)
+	*x = outputs[index].x;
+    if (y)
+	*y = 0;
+    if (width)
+	*width = outputs[index].gbm.width;
+    if (height)
+	*height = outputs[index].gbm.height;
+    return GL_TRUE;
 }
 
 ///
@@ -694,97 +5315,219 @@ static void page_flip_handler(int fd, unsigned int frame,
 //
 void WinLoop ( ESContext *esContext )
 {
-    struct timeval t1, t2;
-    struct timezone tz;
-    float deltatime;
+    double last_time, now;
+    double t, frame_start, wait_start, wait = 0;
+    double input_time;
+    double phases[ES_PHASE_COUNT];
+    int drawn = 0;
+    uint64_t monotonic = 0;
 
     // from drm-legacy.c, legacy-run()
 
-    struct gbm *gbm = (struct gbm *) esContext->platformData;
-  
-    fd_set fds;
-    drmEventContext evctx = {
-	.version = 2,
-	.page_flip_handler = page_flip_handler,
-    };
-    struct gbm_bo *bo;
+    struct drm *drm = &outputs[0].drm;
+    struct output *o;
     struct drm_fb *fb;
-    uint32_t i = 0;
-    int ret;
-  
-    eglSwapBuffers(esContext->eglDisplay, esContext->eglSurface);
-    bo = gbm_surface_lock_front_buffer(gbm->surface);
-    fb = drm_fb_get_from_bo(bo);
-    if (!fb) {
-	fprintf(stderr, "Failed to get a new framebuffer BO\n");
+    int queue_depth = swapchain_depth();
+    int fenced = swapchain_fenced();
+    int i, ret;
+
+    if (event_loop_init(esContext))
+	return;
+    if (!drm->headless &&
+	!event_loop_add(drm->fd, ES_FD_READ, drm_ready, NULL))
 	return;
+    input_init(esContext);
+    inject_init();
+
+    for (i = 0; i < output_count; i++) {
+	o = &outputs[i];
+	o->flip.surface = o->gbm.surface;
+	output_make_current(esContext, i);
+	o->bo = swapchain_init(esContext, &o->gbm, !drm->headless);
+	if (!drm->headless && !o->bo)
+	    return;
+    }
+    startup_mark("swapchain");
+
+    for (i = 0; !drm->headless && i < output_count; i++) {
+	if (output_check_scaling(esContext, i)) {
+	    printf("output %d can't scale %dx%d to %ux%u\n", i,
+		   outputs[i].gbm.width, outputs[i].gbm.height,
+		   outputs[i].drm.dst_w, outputs[i].drm.dst_h);
+	    return;
+	}
+    }
+
+    fb = drm->headless ? NULL : drm_fb_get_from_bo(outputs[0].bo);
+    if (fb && gbm_bo_get_modifier) {
+	stats_modifier = gbm_bo_get_modifier(outputs[0].bo);
+	printf("Scanning out with modifier 0x%016" PRIx64 "\n", stats_modifier);
     }
-  
+
     /* set mode: */
-    ret = drmModeSetCrtc(drm_static.fd, drm_static.crtc_id, fb->fb_id, 0, 0,
-			 &drm_static.connector_id, 1, drm_static.mode);
-    if (ret) {
-	printf("failed to set mode: %s\n", strerror(errno));
-	return;
+    for (i = 0; i < output_count; i++) {
+	o = &outputs[i];
+	fb = drm->headless ? NULL : drm_fb_get_from_bo(o->bo);
+	ret = o->drm.modeset(&o->drm, fb ? fb->fb_id : 0);
+	if (ret) {
+	    printf("failed to set mode: %s\n", strerror(errno));
+	    return;
+	}
     }
+    startup_mark("modeset");
+
+    /* Frame times come from the page flip events when the kernel
+     * stamps them with CLOCK_MONOTONIC, so updates follow what was
+     * actually presented. Otherwise fall back to reading the clock.
+     */
+    if (drm->headless)
+	monotonic = 1;
+    else
+	drmGetCap(drm->fd, DRM_CAP_TIMESTAMP_MONOTONIC, &monotonic);
+    last_time = outputs[0].flip.time = get_time();
 
-    gettimeofday ( &t1 , &tz );
+    stats_init();
+    if (bench.frames)
+	bench_init();
+    frame_start = get_time();
 
     while (1) {
-	struct gbm_bo *next_bo;
-	int waiting_for_flip = 1;
-
-	gettimeofday(&t2, &tz);
-        deltatime = (float)(t2.tv_sec - t1.tv_sec + (t2.tv_usec - t1.tv_usec) * 1e-6);
+	/* pick up flips that completed while we were busy */
+	if (wait_for_flip(&outputs[0].flip, 0))
+	    return;
 
-	if (esContext->updateFunc != NULL)
-            esContext->updateFunc(esContext, deltatime);
+	t = get_time();
+	stats_record(ES_PHASE_FRAME, t - frame_start);
+	stats_record(ES_PHASE_WAIT, wait);
+	stats_frame_done(t);
+	frame_start = t;
+	wait = 0;
 
-	if (esContext->drawFunc != NULL)
-	    esContext->drawFunc(esContext);
-    
-	eglSwapBuffers(esContext->eglDisplay, esContext->eglSurface);
-	next_bo = gbm_surface_lock_front_buffer(gbm->surface);
-	fb = drm_fb_get_from_bo(next_bo);
-	if (!fb) {
-	    fprintf(stderr, "Failed to get a new framebuffer BO\n");
+	if (bench.frames && bench_frame_done(drawn, t))
 	    return;
-	}
-    
-	/*
-	 * Here you could also update drm plane layers if you want
-	 * hw composition
+
+	textures_poll(esContext);
+
+	now = monotonic ? outputs[0].flip.time : get_time();
+	frame_interval = bench.frames ? bench.step : (float)(now - last_time);
+	last_time = now;
+
+	/* threaded, this is only the wait for the update thread */
+	t = get_time();
+	input_time = input_claim();
+	update_run(esContext, frame_interval, &input_time);
+	t = phase_end(ES_PHASE_UPDATE, t);
+
+	/* Each output is drawn and flipped in turn. The first one paces
+	 * the loop; the others needn't share its refresh rate, and one
+	 * whose last flip is still pending sits this frame out instead
+	 * of holding up the rest. Their times add up to one sample per
+	 * phase, so the histograms count frames, not outputs.
 	 */
-    
-	ret = drmModePageFlip(drm_static.fd, drm_static.crtc_id, fb->fb_id,
-			      DRM_MODE_PAGE_FLIP_EVENT, &waiting_for_flip);
-	if (ret) {
-	    printf("failed to queue page flip: %s\n", strerror(errno));
-	    return;
-	}
-    
-	while (waiting_for_flip) {
-	    FD_ZERO(&fds);
-	    FD_SET(0, &fds);
-	    FD_SET(drm_static.fd, &fds);
-      
-	    ret = select(drm_static.fd + 1, &fds, NULL, NULL, NULL);
-	    if (ret < 0) {
-		printf("select err: %s\n", strerror(errno));
+	memset(phases, 0, sizeof(phases));
+	for (i = 0; i < output_count; i++) {
+	    struct gbm_bo *next_bo;
+
+	    o = &outputs[i];
+	    if (i > 0 && o->flip.waiting)
+		continue;
+	    output_make_current(esContext, i);
+
+	    if (o->drm.kms_out_fence_fd != -1) {
+		/* The buffer we are about to render into may still be on
+		 * screen. Make the GPU wait for the flip that replaces it;
+		 * EGL takes ownership of the fence fd.
+		 */
+		EGLSyncKHR kms_fence = create_fence(egl, o->drm.kms_out_fence_fd);
+		o->drm.kms_out_fence_fd = -1;
+		if (kms_fence) {
+		    egl->eglWaitSyncKHR(egl->display, kms_fence, 0);
+		    egl->eglDestroySyncKHR(egl->display, kms_fence);
+		}
+	    }
+
+	    /* layers and benchmark timings belong to the first output */
+	    if (i == 0) {
+		draw_layers(esContext, fenced);
+		if (bench.frames)
+		    bench_gpu_begin();
+	    }
+	    if (esContext->drawFunc != NULL)
+		esContext->drawFunc(esContext);
+	    if (i == 0 && bench.frames)
+		bench_gpu_end(++drawn);
+	    t = phase_add(phases, ES_PHASE_DRAW, t);
+
+	    if (fenced) {
+		/* The fence fd only becomes valid once the commands are
+		 * flushed, which eglSwapBuffers() does for us.
+		 */
+		EGLSyncKHR gpu_fence = create_fence(egl, EGL_NO_NATIVE_FENCE_FD_ANDROID);
+
+		eglSwapBuffers(esContext->eglDisplay, esContext->eglSurface);
+		if (gpu_fence) {
+		    o->drm.kms_in_fence_fd = egl->eglDupNativeFenceFDANDROID(egl->display,
+									    gpu_fence);
+		    egl->eglDestroySyncKHR(egl->display, gpu_fence);
+		}
+	    } else {
+		eglSwapBuffers(esContext->eglDisplay, esContext->eglSurface);
+	    }
+	    t = phase_add(phases, ES_PHASE_SWAP, t);
+
+	    next_bo = o->gbm.surface ? gbm_surface_lock_front_buffer(o->gbm.surface) : NULL;
+	    t = phase_add(phases, ES_PHASE_LOCK, t);
+	    fb = (next_bo && !drm->headless) ? drm_fb_get_from_bo(next_bo) : NULL;
+	    t = phase_add(phases, ES_PHASE_FB, t);
+	    if (!drm->headless && !fb) {
+		fprintf(stderr, "Failed to get a new framebuffer BO\n");
 		return;
-	    } else if (ret == 0) {
-		printf("select timeout!\n");
+	    }
+
+	    /* layers drawn above go out in the same commit as this frame */
+
+	    /* only one commit can be pending at a time on each CRTC */
+	    wait_start = t;
+	    if (wait_for_flip(&o->flip, 1))
 		return;
-	    } else if (FD_ISSET(0, &fds)) {
-		printf("user interrupted!\n");
+	    t = get_time();
+	    wait += t - wait_start;
+
+	    o->flip.waiting = 1;
+	    if (i == 0)
+		o->flip.input_time = input_time;
+	    ret = o->drm.page_flip(&o->drm, fb ? fb->fb_id : 0, o);
+	    t = phase_add(phases, ES_PHASE_FLIP, t);
+	    if (o->drm.kms_in_fence_fd != -1) {
+		/* the kernel holds its own reference now */
+		close(o->drm.kms_in_fence_fd);
+		o->drm.kms_in_fence_fd = -1;
+	    }
+	    if (ret) {
+		printf("failed to queue page flip: %s\n", strerror(errno));
 		return;
 	    }
-	    drmHandleEvent(drm_static.fd, &evctx);
+
+	    if (fenced) {
+		/* the GPU waits on the out fence before reusing it */
+		gbm_surface_release_buffer(o->gbm.surface, o->bo);
+	    } else {
+		/* nothing stops the GPU drawing into the buffer on screen,
+		 * so hang on to it until the flip has happened
+		 */
+		o->flip.release_bo = o->bo;
+	    }
+	    o->bo = next_bo;
+	}
+	for (i = ES_PHASE_DRAW; i <= ES_PHASE_FLIP; i++)
+	    stats_record(i, phases[i]);
+
+	/* the other outputs are skipped until their flips are done */
+	if (queue_depth < 3) {
+	    if (wait_for_flip(&outputs[0].flip, 1))
+		return;
+	    wait += get_time() - t;
 	}
-    
-	/* release last buffer to render on again: */
-	gbm_surface_release_buffer(gbm->surface, bo);
-	bo = next_bo;
     }
 }
 
@@ -803,17 +5546,34 @@ extern int esMain( ESContext *esContext );
 int main ( int argc, char *argv[] )
 {
     ESContext esContext;
+    const char *env_bench = getenv("ES_BENCHMARK");
+    int i;
    
     memset ( &esContext, 0, sizeof( esContext ) );
-
+    startup_mark("start");
+
+    if (env_bench && *env_bench)
+	bench_parse(env_bench);
+    for (i = 1; i < argc; i++) {
+	if (strcmp(argv[i], "--benchmark") == 0)
+	    bench_parse("100,1000");
+	else if (strncmp(argv[i], "--benchmark=", 12) == 0)
+	    bench_parse(argv[i] + 12);
+	else if (strncmp(argv[i], "--benchmark-output=", 19) == 0)
+	    bench.output = argv[i] + 19;
+    }
 
     if ( esMain ( &esContext ) != GL_TRUE )
 	return 1;   
+    startup_mark("app");
  
     WinLoop ( &esContext );
+    update_stop();
 
     if ( esContext.shutdownFunc != NULL )
 	esContext.shutdownFunc ( &esContext );
+    inject_fini();
+    event_loop_fini();
 
     if ( esContext.userData != NULL )
 	free ( esContext.userData );
@@ -0,0 +1,439 @@
+//
+// esUtil_DRM.h
+//
+//    Functions provided by the Linux DRM implementation in addition
+//    to those in esUtil.h. Include this after esUtil.h.
+//
+/*
+ * Copyright (c) 2020 Jan Newmarch <jan@newmarch.name>
+ *
+ * Same license conditions as esUtil_DRM.c
+ */
+
+#ifndef ESUTIL_DRM_H
+#define ESUTIL_DRM_H
+
+#include "esUtil.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+/// \brief Time between the last two frames presented on the display
+/// \param esContext Application context
+/// \return Interval in seconds, the same value passed to the update function
+//
+float ESUTIL_API esGetFrameInterval ( ESContext *esContext );
+
+//
+/// \brief Number of buffers the display cycles through, 2 or 3
+/// \param esContext Application context, after esCreateWindow()
+/// \return The swapchain depth; each extra buffer adds up to a frame of latency
+//
+GLint ESUTIL_API esGetSwapchainDepth ( ESContext *esContext );
+
+//
+/// \brief Number of displays drawn to, more than one with ES_DRM_OUTPUTS
+/// \param esContext Application context, after esCreateWindow()
+/// \return The number of outputs; the draw function is called once for each
+//
+GLint ESUTIL_API esGetOutputCount ( ESContext *esContext );
+
+//
+/// \brief The output the draw function is currently drawing
+/// \param esContext Application context
+/// \return Index of the output, 0 for the first
+//
+GLint ESUTIL_API esGetCurrentOutput ( ESContext *esContext );
+
+//
+/// \brief Where an output sits among all the outputs, placed side by side
+/// \param esContext Application context
+/// \param index Output, from 0 to esGetOutputCount() - 1
+/// \param x, y Top left corner of the output in the combined picture
+/// \param width, height Size of the output in pixels
+/// \return GL_FALSE if there is no such output
+//
+GLboolean ESUTIL_API esGetOutputRect ( ESContext *esContext, GLint index,
+                                       GLint *x, GLint *y,
+                                       GLint *width, GLint *height );
+
+///
+//  Frame statistics
+//
+//  Where the time goes in each iteration of the main loop, kept as
+//  histograms that are cheap enough to update on every frame.
+//
+typedef enum
+{
+   ES_PHASE_UPDATE,     // updateFunc
+   ES_PHASE_DRAW,       // drawFunc
+   ES_PHASE_SWAP,       // eglSwapBuffers
+   ES_PHASE_LOCK,       // gbm_surface_lock_front_buffer
+   ES_PHASE_FB,         // looking up / creating the KMS framebuffer
+   ES_PHASE_FLIP,       // queueing the page flip
+   ES_PHASE_WAIT,       // waiting for page flips to complete
+   ES_PHASE_FRAME,      // start of one frame to the start of the next
+   ES_PHASE_PRESENT,    // between two frames reaching the screen
+   ES_PHASE_LATENCY,    // from an input event to the flip that showed its frame
+   ES_PHASE_COUNT
+} ESFramePhase;
+
+typedef struct
+{
+   unsigned int count;
+   // all in milliseconds
+   float mean;
+   float p50;
+   float p95;
+   float p99;
+   float max;
+} ESPhaseStats;
+
+typedef struct
+{
+   unsigned int frames;
+   GLuint64 modifier;   // layout of the scanout buffers, DRM_FORMAT_MOD_*
+   GLboolean vrr;       // variable refresh rate is on
+   float refresh;       // effective refresh rate in Hz, from the present phase
+   ESPhaseStats phase[ES_PHASE_COUNT];
+} ESFrameStats;
+
+//
+/// \brief Get the frame timing statistics gathered so far
+/// \param esContext Application context
+/// \param stats Filled in with one entry per ESFramePhase
+/// \return GL_TRUE if any frames have been recorded
+//
+GLboolean ESUTIL_API esGetFrameStats ( ESContext *esContext, ESFrameStats *stats );
+
+//
+/// \brief Name of a frame phase, as used when the statistics are dumped
+//
+const char *ESUTIL_API esFramePhaseName ( ESFramePhase phase );
+
+///
+//  Application file descriptors
+//
+//  The main loop waits for page flips with epoll. Other fds (sockets,
+//  input devices, V4L2, ...) can be added to that wait, and their
+//  callback is run on the render thread between frames.
+//
+#define ES_FD_READ      1
+#define ES_FD_WRITE     2
+#define ES_FD_ERROR     4     // reported only, no need to ask for it
+
+typedef void ( ESCALLBACK *ESFdFunc ) ( ESContext *esContext, int fd,
+                                        unsigned int events, void *userData );
+
+//
+/// \brief Call fdFunc from the main loop whenever fd is ready
+/// \param esContext Application context
+/// \param fd File descriptor to watch
+/// \param events ES_FD_READ and/or ES_FD_WRITE
+/// \param fdFunc Called with the ES_FD_* events that are ready
+/// \param userData Passed back to fdFunc
+/// \return GL_TRUE if the fd is now being watched
+//
+GLboolean ESUTIL_API esRegisterFd ( ESContext *esContext, int fd, unsigned int events,
+                                    ESFdFunc fdFunc, void *userData );
+
+//
+/// \brief Stop watching an fd added with esRegisterFd(); safe from its callback
+//
+void ESUTIL_API esUnregisterFd ( ESContext *esContext, int fd );
+
+///
+//  Layers
+//
+//  Extra GL surfaces shown on the display's overlay planes, so the
+//  display hardware composites them over the main window. A layer is
+//  only redrawn after esInvalidateLayer(); until then its last image
+//  stays on screen at no GPU cost. Layers need atomic modesetting and
+//  a free overlay plane that can show ARGB8888, and are drawn with
+//  premultiplied alpha in a context that shares textures, buffers and
+//  programs with the main one (but not VAOs or FBOs). Layer changes
+//  have no commit of their own: they reach the screen together with
+//  the next frame of the main window.
+//
+typedef struct ESLayer ESLayer;
+
+typedef void ( ESCALLBACK *ESLayerDrawFunc ) ( ESContext *esContext, void *userData );
+
+//
+/// \brief Create a layer on an overlay plane
+/// \param esContext Application context
+/// \param x, y Position in the window in pixels
+/// \param width, height Size of the layer in pixels; when the display
+///        scales the window (see esCreateWindow()), layers scale with it
+/// \param zorder Stacking order, higher is nearer the viewer, if the driver allows it
+/// \param drawFunc Draws the layer, with its surface current and the viewport set
+/// \param userData Passed back to drawFunc
+/// \return The new layer, or NULL if no plane is available
+//
+ESLayer *ESUTIL_API esCreateLayer ( ESContext *esContext, GLint x, GLint y,
+                                    GLint width, GLint height, GLint zorder,
+                                    ESLayerDrawFunc drawFunc, void *userData );
+
+//
+/// \brief Move a layer; takes effect with the next frame, without redrawing it
+//
+void ESUTIL_API esSetLayerPosition ( ESLayer *layer, GLint x, GLint y );
+
+//
+/// \brief Set the opacity of the whole layer, 0.0 to 1.0, if the plane supports it
+//
+void ESUTIL_API esSetLayerAlpha ( ESLayer *layer, GLfloat alpha );
+
+//
+/// \brief Have drawFunc called again before the next frame
+//
+void ESUTIL_API esInvalidateLayer ( ESLayer *layer );
+
+//
+/// \brief Take a layer off the display and free it
+//
+void ESUTIL_API esDestroyLayer ( ESLayer *layer );
+
+///
+//  dma-buf import
+//
+//  Video frames that are already in dma-bufs (from a decoder, a camera
+//  or another process) can be sampled in place, with no copy and no
+//  colour conversion on the CPU. Each buffer is imported once as an
+//  EGLImage and reused whenever the same dma-buf comes round again.
+//
+typedef struct
+{
+   GLint    width;
+   GLint    height;
+   GLuint   fourcc;         // DRM_FORMAT_*, e.g. DRM_FORMAT_NV12
+   GLint    planes;
+   int      fd[4];          // -1 for planes in the same dma-buf as plane 0
+   GLuint   offset[4];
+   GLuint   pitch[4];
+   GLuint64 modifier;       // DRM_FORMAT_MOD_INVALID if not known
+} ESDmaBuf;
+
+//
+/// \brief Bind a dma-buf to texture as GL_TEXTURE_EXTERNAL_OES
+/// \param esContext Application context
+/// \param buf The frame
+/// \param texture Texture name, sampled with samplerExternalOES which
+///        returns RGB, the driver doing any YUV conversion
+/// \return GL_TRUE if the buffer could be imported
+//
+GLboolean ESUTIL_API esBindDmaBufExternal ( ESContext *esContext, const ESDmaBuf *buf,
+                                            GLuint texture );
+
+//
+/// \brief Bind the planes of an NV12 dma-buf to two GL_TEXTURE_2Ds
+/// \param esContext Application context
+/// \param buf The frame
+/// \param textures Luma (R8) and chroma (GR88) textures, converted to RGB
+///        in the fragment shader; for drivers without external YUV images
+/// \return GL_TRUE if the buffer could be imported
+//
+GLboolean ESUTIL_API esBindDmaBufPlanes ( ESContext *esContext, const ESDmaBuf *buf,
+                                          const GLuint textures[2] );
+
+//
+/// \brief Drop the EGLImages kept for a dma-buf, before its producer frees it
+//
+void ESUTIL_API esReleaseDmaBuf ( ESContext *esContext, int fd );
+
+//
+/// \brief Raw NV12 frames from a file, delivered in dma-bufs like a decoder would
+//
+typedef struct ESVideoFile ESVideoFile;
+
+//
+/// \brief Open a file of raw NV12 frames
+/// \param esContext Application context
+/// \param filename File of back to back frames, e.g. from
+///        ffmpeg -i in.mp4 -pix_fmt nv12 -f rawvideo out.nv12
+/// \param width, height Frame size, both even
+//
+ESVideoFile *ESUTIL_API esOpenVideoFile ( ESContext *esContext, const char *filename,
+                                          GLint width, GLint height );
+
+//
+/// \brief Read the next frame, going back to the start at the end of the file
+/// \return The frame, valid until a few more frames have been read, or NULL
+//
+const ESDmaBuf *ESUTIL_API esVideoFileFrame ( ESVideoFile *video );
+
+void ESUTIL_API esCloseVideoFile ( ESVideoFile *video );
+
+///
+//  V4L2 capture
+//
+//  Camera frames as dma-bufs, ready for esBindDmaBufExternal() or
+//  esBindDmaBufPlanes(). New frames are picked up by the main loop as
+//  they arrive; a frame is given back to the camera once the GPU has
+//  finished with it.
+//
+typedef struct ESCapture ESCapture;
+
+//
+/// \brief Start capturing from a V4L2 device
+/// \param esContext Application context
+/// \param device e.g. "/dev/video0"
+/// \param width, height Requested frame size; the driver may adjust it
+/// \param fourcc Pixel format, e.g. V4L2_PIX_FMT_NV12 or V4L2_PIX_FMT_YUYV
+/// \return The capture, or NULL if the device can't provide the format
+//
+ESCapture *ESUTIL_API esOpenCapture ( ESContext *esContext, const char *device,
+                                      GLint width, GLint height, GLuint fourcc );
+
+//
+/// \brief The newest frame, to draw with this frame
+/// \return The frame, or NULL until the first one arrives
+//
+const ESDmaBuf *ESUTIL_API esCaptureFrame ( ESCapture *capture );
+
+void ESUTIL_API esCloseCapture ( ESCapture *capture );
+
+///
+//  Input
+//
+//  Keyboards, mice and touchscreens are read from /dev/input/event*
+//  (or the comma separated devices in ES_INPUT; ES_INPUT=0 for none)
+//  by the main loop, between frames. Key presses go to the keyFunc
+//  given to esRegisterKeyFunc(), with the pointer position. Positions
+//  are in pixels of the first output, from the top left corner.
+//
+//  The key, pointer and touch callbacks run on the main thread. With
+//  the update thread of esRegisterUpdateState() they run while the
+//  update function may be running, so they must not touch
+//  esGetUpdateState(); input meant for the update function has to be
+//  handed over under the application's own lock, or through atomics.
+//
+#define ES_BUTTON_LEFT    1
+#define ES_BUTTON_RIGHT   2
+#define ES_BUTTON_MIDDLE  4
+
+#define ES_TOUCH_DOWN     0
+#define ES_TOUCH_MOVE     1
+#define ES_TOUCH_UP       2
+
+typedef void ( ESCALLBACK *ESPointerFunc ) ( ESContext *esContext, GLint x, GLint y,
+                                             GLuint buttons, double time );
+typedef void ( ESCALLBACK *ESTouchFunc ) ( ESContext *esContext, GLint id, GLint state,
+                                           GLint x, GLint y, double time );
+
+//
+/// \brief Call pointerFunc when the mouse moves or a button changes
+/// \param pointerFunc Gets the position, the ES_BUTTON_* held down and
+///        the event time in seconds, on the clock of esGetInputTime().
+///        Runs on the main thread, alongside any update thread
+//
+void ESUTIL_API esRegisterPointerFunc ( ESContext *esContext, ESPointerFunc pointerFunc );
+
+//
+/// \brief Call touchFunc for each touch point that goes down, moves or lifts
+/// \param touchFunc Gets the touch point (0 to 9, kept while it is down),
+///        ES_TOUCH_DOWN, ES_TOUCH_MOVE or ES_TOUCH_UP, its position and the event time.
+///        Runs on the main thread, alongside any update thread
+//
+void ESUTIL_API esRegisterTouchFunc ( ESContext *esContext, ESTouchFunc touchFunc );
+
+//
+/// \brief When the input event being handled happened, e.g. in keyFunc
+/// \return Kernel timestamp in seconds on CLOCK_MONOTONIC, the clock of the
+///        page flip times
+//
+double ESUTIL_API esGetInputTime ( ESContext *esContext );
+
+//
+/// \brief Load, compile and link a program, like esLoadProgram(), reusing the
+///        program binary from an earlier run when the driver accepts it.
+///        The program comes back already linked, and one loaded from a binary
+///        has no shaders to relink with, so give attributes their locations
+///        with layout qualifiers in the source rather than glBindAttribLocation()
+/// \param vertShaderSrc Vertex shader source code
+/// \param fragShaderSrc Fragment shader source code
+/// \return A new program object linked with the vertex/fragment shader pair, 0 on failure
+//
+GLuint ESUTIL_API esLoadProgramCached ( const char *vertShaderSrc, const char *fragShaderSrc );
+
+//
+/// \brief Load a 2D or cube map texture with all its mip levels from a KTX or KTX2 file
+/// \param ioContext Context related to IO facility on the platform
+/// \param fileName Name of the file; ETC2/EAC, ASTC (with
+///        GL_KHR_texture_compression_astc_ldr) or 8-bit RGB(A) data
+/// \param width Width of the level 0 image, if not NULL
+/// \param height Height of the level 0 image, if not NULL
+/// \return The texture, still bound, or 0 on error
+//  (in esUtil.c, alongside esLoadTGA())
+//
+GLuint ESUTIL_API esLoadKTX ( void *ioContext, const char *fileName, int *width, int *height );
+
+///
+//  Asynchronous texture loading
+//
+typedef void ( ESCALLBACK *ESTextureFunc ) ( ESContext *esContext, GLuint texture,
+                                             GLint width, GLint height, void *userData );
+
+//
+/// \brief Load a TGA file into a mipmapped texture without blocking the main loop
+/// \param esContext Application context
+/// \param fileName Uncompressed 8, 24 or 32-bit TGA file, as for esLoadTGA()
+/// \param doneFunc Called from the main loop once the texture is ready to
+///        draw with, or with texture 0 if the file couldn't be loaded
+/// \param userData Passed back to doneFunc
+/// \return GL_TRUE if the load was started
+//
+GLboolean ESUTIL_API esLoadTextureAsync ( ESContext *esContext, const char *fileName,
+                                          ESTextureFunc doneFunc, void *userData );
+
+///
+//  Update thread
+//
+
+//
+/// \brief Run the update function on a thread of its own, a frame ahead of drawing
+/// \param esContext Application context, from esMain()
+/// \param size Size of the state the update function hands to the draw function.
+///        The update function may then only write to esGetUpdateState() and
+///        its own data, and must not call GL; the draw function reads
+///        esGetDrawState(). ES_UPDATE_THREAD=0 keeps the update on the main thread.
+///        Key, pointer and touch callbacks stay on the main thread and run at the
+///        same time as the update function (see Input above)
+/// \return GL_FALSE if the state could not be allocated
+//
+GLboolean ESUTIL_API esRegisterUpdateState ( ESContext *esContext, size_t size );
+
+//
+/// \brief State for the update function to write, a copy of the previous frame's
+/// \param esContext Application context
+/// \return The update function's copy of the state; in esMain() the initial state.
+///        Only for esMain() and the update function, not for input callbacks
+//
+void *ESUTIL_API esGetUpdateState ( ESContext *esContext );
+
+//
+/// \brief State for the draw function to read, as left by the last finished update
+/// \param esContext Application context
+/// \return The draw function's copy of the state
+//
+const void *ESUTIL_API esGetDrawState ( ESContext *esContext );
+
+///
+//  Library internal
+//
+//  Shared between esUtil.c and esUtil_DRM.c, not for applications.
+//
+
+// The ES_WINDOW_* flags given to esCreateWindow()
+extern GLuint esWindowFlags;
+
+// Whether ES_DEBUG asks for the EGL and GL details at startup
+GLboolean esDebugEnabled ( void );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ESUTIL_DRM_H